@@ -0,0 +1,59 @@
+#include <stdbool.h>
+#include "emulator.h"
+#include "backlog.h"
+
+static size_t ring_entries(int limit)
+{
+  size_t ring;
+
+  if (limit <= 0)
+    return 0;
+  for (ring = 1; ring < (size_t)limit; ring <<= 1)
+    ;
+  return ring;
+}
+
+size_t backlog_bytes(int limit)
+{
+  return ring_entries(limit) * sizeof(struct backlog_entry);
+}
+
+void backlog_init(struct backlog *b, int limit, void *storage)
+{
+  b->ring = storage;
+  b->limit = limit > 0 ? limit : 0;
+  b->mask = (int)ring_entries(limit) - 1;
+  b->head = 0;
+  b->count = 0;
+}
+
+bool backlog_put(struct sim *s, struct backlog *b, const struct msg *m)
+{
+  struct sim_stats *st = sim_stats(s);
+  struct backlog_entry *e;
+
+  if (b->count >= b->limit)
+    return false;
+  e = &b->ring[(b->head + b->count) & b->mask];
+  e->since = sim_time(s);
+  e->msg = *m;
+  b->count++;
+  st->backlogged++;
+  if (b->count > st->backlog_max)
+    st->backlog_max = b->count;
+  return true;
+}
+
+bool backlog_get(struct sim *s, struct backlog *b, struct msg *m)
+{
+  struct backlog_entry *e;
+
+  if (b->count == 0)
+    return false;
+  e = &b->ring[b->head];
+  *m = e->msg;
+  hist_record(&sim_stats(s)->backlog_delay, sim_time(s) - e->since);
+  b->head = (b->head + 1) & b->mask;
+  b->count--;
+  return true;
+}
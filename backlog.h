@@ -0,0 +1,30 @@
+/* messages layer 5 hands a sender while its window is full.  Rather than
+   drop them, the sender can hold up to a limit of them and send them,
+   oldest first, as ACKs open the window.  The ring lives in storage the
+   sender provides, backlog_bytes() of it, so a sender that carves its
+   state out of one block can carve the backlog out of it too.  The
+   functions keep the backlog statistics in sim_stats up to date. */
+
+struct backlog_entry {
+  double since;          /* when the message was queued */
+  struct msg msg;
+};
+
+struct backlog {
+  struct backlog_entry *ring;   /* 2^n entries */
+  int limit;                    /* most messages held, 0 to hold none */
+  int mask;                     /* ring entries - 1 */
+  int head;                     /* index of the oldest message */
+  int count;                    /* messages held */
+};
+
+/* storage a backlog of limit messages needs, 0 if limit <= 0 */
+extern size_t backlog_bytes(int limit);
+
+extern void backlog_init(struct backlog *, int limit, void *storage);
+
+/* queue a message.  Returns false if the backlog is full. */
+extern bool backlog_put(struct sim *, struct backlog *, const struct msg *);
+
+/* take the oldest message.  Returns false if there is none. */
+extern bool backlog_get(struct sim *, struct backlog *, struct msg *);
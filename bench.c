@@ -0,0 +1,133 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+#include "emulator.h"
+
+/* ******************************************************************
+   Simulator throughput benchmark.
+
+   Runs a fixed set of scenarios through the emulator library with
+   TRACE 0 and prints one JSON object per scenario: events dispatched,
+   events per second, ns per event, the simulation's peak heap bytes,
+   the process's peak RSS and heap allocations per message.  Build it
+   with "make bench", which links one copy against each protocol
+   (bench_gbn, bench_sr) with trace output compiled out.
+
+   usage: bench_gbn [-q] [scenario ...]
+
+   -q divides every message count by 10 for a quick check.  Naming
+   scenarios runs only those.
+**********************************************************************/
+
+#ifndef PROTOCOL
+#define PROTOCOL "unknown"
+#endif
+
+struct scenario {
+  const char *name;
+  long long nsimmax;
+  double lossprob;
+  double corruptprob;
+  double lambda;
+  int timeout;
+  int windowsize;       /* 0 for the protocol's default */
+  double bandwidth;     /* 0 for the original channel delay */
+  int flows;            /* sender/receiver pairs sharing the link */
+};
+
+static const struct scenario scenarios[] = {
+  { "loss0",        200000, 0.0, 0.0,   10.0, TIMEOUT_FIXED,       0, 0.0,    1 },
+  { "loss10",       200000, 0.1, 0.0,   10.0, TIMEOUT_FIXED,       0, 0.0,    1 },
+  { "loss30",       200000, 0.3, 0.0,   10.0, TIMEOUT_FIXED,       0, 0.0,    1 },
+  { "corrupt10",    200000, 0.0, 0.1,   10.0, TIMEOUT_FIXED,       0, 0.0,    1 },
+  { "fastarrivals", 200000, 0.1, 0.1,    1.0, TIMEOUT_FIXED,       0, 0.0,    1 },
+  { "long",        2000000, 0.1, 0.1,   10.0, TIMEOUT_FIXED,       0, 0.0,    1 },
+  { "adaptive10",   200000, 0.1, 0.0,   10.0, TIMEOUT_ADAPTIVE,    0, 0.0,    1 },
+  { "window4k",     200000, 0.1, 0.0,   10.0, TIMEOUT_ADAPTIVE, 4096, 0.0,    1 },
+  { "bottleneck",   200000, 0.0, 0.0,    1.0, TIMEOUT_ADAPTIVE,   64, 0.5,    1 },
+  { "flows1k",      200000, 0.0, 0.0, 2000.0, TIMEOUT_ADAPTIVE,  16, 0.5, 1000 },
+};
+
+#define NSCENARIOS ((int)(sizeof(scenarios) / sizeof(scenarios[0])))
+
+static double now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int selected(const char *name, int argc, char **argv, int first)
+{
+  int i;
+
+  if (first >= argc)
+    return 1;
+  for (i = first; i < argc; i++)
+    if (strcmp(argv[i], name) == 0)
+      return 1;
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  const struct scenario *sc;
+  const struct sim_stats *st;
+  struct sim_params p;
+  struct rusage ru;
+  struct sim *s;
+  double start, elapsed;
+  int first = 1, quick = 0, i;
+
+  if (argc > 1 && strcmp(argv[1], "-q") == 0) {
+    quick = 1;
+    first = 2;
+  }
+
+  for (i = 0; i < NSCENARIOS; i++) {
+    sc = &scenarios[i];
+    if (!selected(sc->name, argc, argv, first))
+      continue;
+
+    sim_defaults(&p);
+    p.nsimmax = quick ? sc->nsimmax / 10 : sc->nsimmax;
+    p.lossprob = sc->lossprob;
+    p.corruptprob = sc->corruptprob;
+    p.corruptdirection = 2;
+    p.lambda = sc->lambda;
+    p.timeout = sc->timeout;
+    p.windowsize = sc->windowsize;
+    p.bandwidth = sc->bandwidth;
+    p.flows = sc->flows;
+    p.trace = 0;
+    p.seed = 1;
+
+    start = now();
+    s = sim_create(&p);
+    if (s == NULL) {
+      fprintf(stderr, "%s: could not create simulation\n", sc->name);
+      return EXIT_FAILURE;
+    }
+    sim_run(s);
+    elapsed = now() - start;
+    st = sim_results(s);
+    getrusage(RUSAGE_SELF, &ru);
+
+    printf("{\"protocol\": \"%s\", \"scenario\": \"%s\", \"messages\": %lld, "
+           "\"delivered\": %lld, \"events\": %lld, \"seconds\": %.6f, "
+           "\"events_per_sec\": %.0f, \"ns_per_event\": %.2f, "
+           "\"peak_heap_bytes\": %lld, \"maxrss_kb\": %ld, "
+           "\"allocs\": %lld, \"allocs_per_msg\": %.6f}\n",
+           PROTOCOL, sc->name, st->nsim, st->messages_delivered, st->events, elapsed,
+           elapsed > 0 ? st->events / elapsed : 0.0,
+           st->events ? elapsed * 1e9 / st->events : 0.0,
+           st->peak_bytes, ru.ru_maxrss, st->allocs,
+           st->nsim ? (double)st->allocs / st->nsim : 0.0);
+    fflush(stdout);
+    sim_destroy(s);
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,142 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <pthread.h>
+#include "emulator.h"
+#include "checksum.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define HAVE_CRC32_INSN 1
+#endif
+
+#define CRC32C_POLY 0x82f63b78u   /* reflected Castagnoli polynomial */
+
+static uint32_t crctable[8][256];   /* slicing-by-8 tables */
+static uint32_t (*crc32c_impl)(uint32_t, const void *, size_t);
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static const char *names[CKSUM_NENGINES] = { "sum", "crc32c" };
+
+const char *cksum_name(int engine)
+{
+  return engine >= 0 && engine < CKSUM_NENGINES ? names[engine] : "?";
+}
+
+static uint32_t crc32c_slice8(uint32_t crc, const void *buf, size_t len)
+{
+  const unsigned char *p = buf;
+  uint64_t w;
+
+  crc = ~crc;
+  /* eight bytes per step, one table lookup for each */
+  while (len >= 8) {
+    memcpy(&w, p, 8);
+    w ^= crc;                       /* little endian: low bytes first */
+    crc = crctable[7][w & 0xff] ^ crctable[6][(w >> 8) & 0xff]
+      ^ crctable[5][(w >> 16) & 0xff] ^ crctable[4][(w >> 24) & 0xff]
+      ^ crctable[3][(w >> 32) & 0xff] ^ crctable[2][(w >> 40) & 0xff]
+      ^ crctable[1][(w >> 48) & 0xff] ^ crctable[0][w >> 56];
+    p += 8;
+    len -= 8;
+  }
+  while (len-- > 0)
+    crc = crctable[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
+
+#ifdef HAVE_CRC32_INSN
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const void *buf, size_t len)
+{
+  const unsigned char *p = buf;
+
+  crc = ~crc;
+#ifdef __x86_64__
+  {
+    uint64_t w, c = crc;
+
+    while (len >= 8) {
+      memcpy(&w, p, 8);
+      c = _mm_crc32_u64(c, w);
+      p += 8;
+      len -= 8;
+    }
+    crc = (uint32_t)c;
+  }
+#endif
+  while (len >= 4) {
+    uint32_t w;
+
+    memcpy(&w, p, 4);
+    crc = _mm_crc32_u32(crc, w);
+    p += 4;
+    len -= 4;
+  }
+  while (len-- > 0)
+    crc = _mm_crc32_u8(crc, *p++);
+  return ~crc;
+}
+#endif
+
+/* build the tables and pick an implementation, once per process */
+static void crc32c_init(void)
+{
+  uint32_t c;
+  int i, j;
+
+  for (i = 0; i < 256; i++) {
+    c = (uint32_t)i;
+    for (j = 0; j < 8; j++)
+      c = (c >> 1) ^ (c & 1 ? CRC32C_POLY : 0);
+    crctable[0][i] = c;
+  }
+  for (i = 0; i < 256; i++)
+    for (j = 1; j < 8; j++)
+      crctable[j][i] = (crctable[j-1][i] >> 8) ^ crctable[0][crctable[j-1][i] & 0xff];
+
+  crc32c_impl = crc32c_slice8;
+#ifdef HAVE_CRC32_INSN
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse4.2"))
+    crc32c_impl = crc32c_hw;
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+  pthread_once(&crc32c_once, crc32c_init);
+  return crc32c_impl(crc, buf, len);
+}
+
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len)
+{
+  pthread_once(&crc32c_once, crc32c_init);
+  return crc32c_slice8(crc, buf, len);
+}
+
+int crc32c_hw_available(void)
+{
+  pthread_once(&crc32c_once, crc32c_init);
+  return crc32c_impl != crc32c_slice8;
+}
+
+int pkt_checksum(int engine, const struct pkt *packet)
+{
+  unsigned char buf[8 + 20];
+  int checksum, i;
+
+  if (engine == CKSUM_CRC32C) {
+    /* the header fields and the payload as one contiguous buffer */
+    memcpy(buf, &packet->seqnum, 4);
+    memcpy(buf + 4, &packet->acknum, 4);
+    memcpy(buf + 8, packet->payload, 20);
+    return (int)crc32c(0, buf, sizeof(buf));
+  }
+
+  checksum = packet->seqnum;
+  checksum += packet->acknum;
+  for (i = 0; i < 20; i++)
+    checksum += (int)(packet->payload[i]);
+  return checksum;
+}
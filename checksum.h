@@ -0,0 +1,33 @@
+#include <stdint.h>
+#include <stddef.h>
+
+/* packet checksums.  The engine is chosen per simulation; both ends of a
+   simulation use the same one.
+
+   CKSUM_SUM is the original checksum: seqnum + acknum + the payload
+   bytes.  It misses any corruption that keeps the sum, such as two
+   bytes swapped or one byte up and another down by the same amount.
+
+   CKSUM_CRC32C is CRC-32C (Castagnoli) over seqnum, acknum and the
+   payload.  It uses the SSE4.2 crc32 instruction when the CPU has it and
+   slicing-by-8 tables otherwise. */
+
+#define CKSUM_SUM     0
+#define CKSUM_CRC32C  1
+#define CKSUM_NENGINES 2
+
+struct pkt;
+
+/* checksum of everything in the packet except its checksum field */
+extern int pkt_checksum(int engine, const struct pkt *);
+
+extern const char *cksum_name(int engine);
+
+/* CRC-32C of a buffer, continuing from crc (0 to start) */
+extern uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+/* the portable implementation, whatever the CPU supports */
+extern uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len);
+
+/* non-zero if crc32c() uses the crc32 instruction */
+extern int crc32c_hw_available(void);
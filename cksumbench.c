@@ -0,0 +1,193 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include "emulator.h"
+#include "checksum.h"
+
+/* ******************************************************************
+   Checksum microbenchmark.
+
+   For each checksum engine, times the checksum of a stream of packets
+   and counts the corruptions it fails to detect.  A corruption goes
+   undetected when the packet changed but its checksum did not.  Prints
+   one JSON object per engine.
+
+   usage: bench_cksum [-q]
+
+   -q runs a tenth of the iterations.
+
+   Corruption models:
+     emulator  what tolayer3() does: payload[0] = 'Z', or seqnum or
+               acknum set to 999999
+     swap      two different payload bytes swapped
+     offset    one byte up by d and another down by d
+     bytes     2 to 4 random bytes of header or payload replaced
+     burst     up to 32 consecutive bits flipped
+**********************************************************************/
+
+#define NMODELS 5
+
+static const char *models[NMODELS] = { "emulator", "swap", "offset", "bytes", "burst" };
+
+static uint64_t rngstate = 0x9e3779b97f4a7c15ULL;
+
+/* xorshift64*, good enough to pick bytes and bits */
+static uint64_t rnd(void)
+{
+  rngstate ^= rngstate >> 12;
+  rngstate ^= rngstate << 25;
+  rngstate ^= rngstate >> 27;
+  return rngstate * 0x2545f4914f6cdd1dULL;
+}
+
+static double now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void randompkt(struct pkt *p)
+{
+  int i;
+
+  p->seqnum = (int)(rnd() % 1024);
+  p->acknum = rnd() & 1 ? -1 : (int)(rnd() % 1024);
+  for (i = 0; i < 20; i++)
+    p->payload[i] = (char)('a' + rnd() % 26);
+}
+
+/* the bytes a checksum covers: seqnum, acknum and the payload */
+static unsigned char *coveredbyte(struct pkt *p, int i)
+{
+  if (i < 4)
+    return (unsigned char *)&p->seqnum + i;
+  if (i < 8)
+    return (unsigned char *)&p->acknum + i - 4;
+  return (unsigned char *)p->payload + i - 8;
+}
+
+static void corrupt(struct pkt *p, int model)
+{
+  unsigned char *a, *b, t;
+  int i, n, start, len, bit;
+  double x;
+
+  switch (model) {
+  case 0:
+    if ((x = (rnd() >> 11) * 0x1p-53) < .75)
+      p->payload[0] = 'Z';
+    else if (x < .875)
+      p->seqnum = 999999;
+    else
+      p->acknum = 999999;
+    break;
+  case 1:
+    a = (unsigned char *)&p->payload[rnd() % 20];
+    b = (unsigned char *)&p->payload[rnd() % 20];
+    t = *a; *a = *b; *b = t;
+    break;
+  case 2:
+    a = coveredbyte(p, (int)(rnd() % 28));
+    b = coveredbyte(p, (int)(rnd() % 28));
+    n = 1 + (int)(rnd() % 8);
+    *a += n;
+    *b -= n;
+    break;
+  case 3:
+    n = 2 + (int)(rnd() % 3);
+    for (i = 0; i < n; i++)
+      *coveredbyte(p, (int)(rnd() % 28)) = (unsigned char)rnd();
+    break;
+  case 4:
+    len = 1 + (int)(rnd() % 32);
+    start = (int)(rnd() % (28*8 - len + 1));
+    for (bit = start; bit < start + len; bit++)
+      if (bit == start || bit == start + len - 1 || (rnd() & 1))
+        *coveredbyte(p, bit / 8) ^= (unsigned char)(1 << (bit % 8));
+    break;
+  }
+}
+
+static int samepkt(const struct pkt *a, const struct pkt *b)
+{
+  return a->seqnum == b->seqnum && a->acknum == b->acknum
+    && memcmp(a->payload, b->payload, 20) == 0;
+}
+
+/* ns per packet for engine, or for the portable CRC-32C if sw */
+static double timeengine(int engine, int sw, long iters)
+{
+  static struct pkt pkts[1024];
+  volatile int sink;
+  unsigned char buf[28];
+  double start;
+  long i;
+  int sum = 0;
+
+  for (i = 0; i < 1024; i++)
+    randompkt(&pkts[i]);
+  start = now();
+  for (i = 0; i < iters; i++) {
+    if (sw) {
+      memcpy(buf, &pkts[i & 1023].seqnum, 4);
+      memcpy(buf + 4, &pkts[i & 1023].acknum, 4);
+      memcpy(buf + 8, pkts[i & 1023].payload, 20);
+      sum += (int)crc32c_sw(0, buf, sizeof(buf));
+    }
+    else
+      sum += pkt_checksum(engine, &pkts[i & 1023]);
+  }
+  sink = sum;
+  (void)sink;
+  return (now() - start) * 1e9 / iters;
+}
+
+int main(int argc, char **argv)
+{
+  struct pkt orig, bad;
+  long iters = 20000000, trials = 2000000, t, missed[NMODELS], changed[NMODELS];
+  int engine, m;
+
+  if (argc > 1 && strcmp(argv[1], "-q") == 0) {
+    iters /= 10;
+    trials /= 10;
+  }
+
+  /* the CRC-32C check value */
+  if (crc32c(0, "123456789", 9) != 0xe3069283u || crc32c_sw(0, "123456789", 9) != 0xe3069283u) {
+    fprintf(stderr, "crc32c gives the wrong check value\n");
+    return EXIT_FAILURE;
+  }
+
+  for (engine = 0; engine < CKSUM_NENGINES; engine++) {
+    for (m = 0; m < NMODELS; m++) {
+      missed[m] = changed[m] = 0;
+      for (t = 0; t < trials; t++) {
+        randompkt(&orig);
+        orig.checksum = pkt_checksum(engine, &orig);
+        bad = orig;
+        corrupt(&bad, m);
+        if (samepkt(&orig, &bad))
+          continue;             /* nothing to detect */
+        changed[m]++;
+        if (pkt_checksum(engine, &bad) == bad.checksum)
+          missed[m]++;
+      }
+    }
+    printf("{\"engine\": \"%s\", \"impl\": \"%s\", \"ns_per_packet\": %.2f",
+           cksum_name(engine),
+           engine == CKSUM_CRC32C ? (crc32c_hw_available() ? "sse4.2" : "slicing-by-8") : "c",
+           timeengine(engine, 0, iters));
+    if (engine == CKSUM_CRC32C && crc32c_hw_available())
+      printf(", \"ns_per_packet_slicing_by_8\": %.2f", timeengine(engine, 1, iters));
+    for (m = 0; m < NMODELS; m++)
+      printf(", \"undetected_%s\": %.3e", models[m],
+             changed[m] ? (double)missed[m] / changed[m] : 0.0);
+    printf("}\n");
+  }
+  return EXIT_SUCCESS;
+}
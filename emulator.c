@@ -33,299 +33,742 @@
    soon as n packets are sent.
    - fixed C style to adhere to current programming style
 
+   Modifications:
+   - all emulator state lives in a struct sim so several simulations can
+   run in one process.  The emulator is driven through sim_create(),
+   sim_run() and sim_destroy(); build with -DSIM_NO_MAIN to use it as a
+   library without the interactive main().  See the Makefile for the
+   programs built from it.
+   - --sweep runs a grid of parameters on all cores (see sweep.c).
+   - random numbers come from per-simulation xoshiro256** streams instead
+   of rand(); --seed picks the seed.
+   - --trace-file writes a compact binary record of every event from a
+   background thread (trace.c); read it back with tracedump.
+   - --timeout adaptive makes the senders estimate their retransmission
+   timeout from measured round trips (rto.c) instead of using RTT.
+   - --fast-retransmit N makes the GBN sender resend its window after N
+   duplicate ACKs instead of waiting for the timer.
+   - --window and --seqspace set the protocols' window and sequence
+   space at run time.
+   - --sack makes the SR receiver acknowledge cumulatively, with a bitmap
+   of the packets it holds beyond the cumulative ack.
+   - --per-packet-timers gives every unacked SR packet its own
+   retransmission timer instead of timing only the oldest.
+   - --delayed-ack K makes the GBN receiver ACK every K packets, or
+   --ack-delay after the first unacknowledged one.
+   - --checksum crc32c validates packets with CRC-32C instead of the sum
+   (checksum.c); cksumbench compares the two.
+   - --bandwidth R replaces the random channel delay with a link model:
+   each direction transmits R packets per time unit from a drop-tail
+   queue of --queue packets, and a packet arrives --prop-delay after it
+   has been transmitted.  Link utilization and queue occupancy are
+   reported.
+   - --backlog N makes the senders hold up to N messages that arrive
+   while the window is full, and send them as the window opens, instead
+   of dropping them.  Backlog depth and queueing delay are reported.
+   - --bidirectional generates messages at both entities, replacing the
+   compile-time BIDIRECTIONAL; goodput is reported per direction.
+   - --flows N simulates N sender/receiver pairs, each with its own
+   arrival process and protocol state, sharing the channel (and the link
+   of --bandwidth) in each direction.  Entity 2f is the A end of flow f
+   and 2f+1 its B end; the protocol code still sees only A and B, of the
+   flow whose event is being handled.  Per-flow goodput and Jain's
+   fairness index are reported.
+   - --msg-size N[:M] makes the application messages N bytes long, or
+   uniform on N..M bytes, instead of 20.  Each end holds the message it
+   is segmenting, and up to --backlog more, and hands the entity one
+   struct msg per fragment whenever A_room()/B_room() say it has room;
+   the receiving end reassembles them in a buffer.  A message arriving
+   when the sender holds all it can is dropped.  Latency is measured
+   per whole message and goodput is also reported in bytes.
+
    ********************************************************************* */
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <stdint.h>
 #include "emulator.h"
 #include "gbn.h"
+#include "sweep.h"
+#include "trace.h"
+#include "checksum.h"
 
 struct event {
-  float evtime;           /* event time */
+  double evtime;          /* event time */
   int evtype;             /* event type code */
   int eventity;           /* entity where event occurs */
   struct pkt *pktptr;     /* ptr to packet (if any) assoc w/ this event */
-  struct event *prev;
-  struct event *next;
+  uint64_t evseq;         /* insertion order, breaks ties between equal times */
+  int heappos;            /* index of this event in the event heap */
+  struct event *nextfree; /* link in the free list while not in use */
+  struct pkt pkt;         /* storage for the packet of a FROM_LAYER3 event */
 };
 
-struct event *evlist = NULL;   /* the event list */
+/* event records are carved out of fixed-size chunks and recycled through a
+   free list, so once the pool has grown to the peak number of pending
+   events the simulation makes no further heap calls. */
+#define EVPOOLCHUNK 256
+
+struct evchunk {
+  struct evchunk *next;
+  struct event ev[EVPOOLCHUNK];
+};
 
 /* possible events: */
 #define  TIMER_INTERRUPT 0  
 #define  FROM_LAYER5     1
 #define  FROM_LAYER3     2
+#define  TIMER_CANCELLED 3   /* stopped timer, discarded when it reaches the head */
 
 #define  OFF             0
 #define  ON              1
 
-int TRACE = 3;
-
-/* statistics updated by GBN */
-int window_full;   /* count of the number of messages dropped due to full window */
-int total_ACKs_received;
-int packets_resent;       /* count of the number of packets resent  */
-int new_ACKs;           /* count of the number of acks correctly received */
-int packets_received;  /* count of the packets received by receiver */
-
-/* statistics updated by emulator */
-static int packets_lost;  
-static int packets_corrupt;
-static int packets_sent;
-static int packets_timeout;
-static int messages_delivered;
-
-static int nsim = 0;              /* number of messages from 5 to 4 so far */ 
-static int nsimmax = 0;           /* number of msgs to generate, then stop */
-static float time = 0.000;
-static float lossprob;            /* probability that a packet is dropped  */
-static float corruptprob;   /* probability that one bit is packet is flipped */
-static int corruptdirection; /* A->B A<-B or bidirectional corruption/loss */
-static float lambda;        /* arrival rate of messages from layer 5 */   
-static int   ntolayer3;           /* number sent into layer 3 */
-static int   nlost;               /* number lost in media */
-static int ncorrupt;              /* number corrupted by media*/
+/* independent random number streams, one per kind of decision, so that
+   e.g. changing the loss probability does not shift the arrival times */
+#define  RAND_LOSS       0
+#define  RAND_CORRUPT    1
+#define  RAND_DELAY      2
+#define  RAND_ARRIVAL    3
+#define  RAND_SIZE       4
+#define  NRANDSTREAMS    5
+
+/* variable-size messages (params.msgsize > 0) travel as fragments of one
+   struct msg each: a 4-byte big-endian header, then FRAGDATA bytes of the
+   message.  The header of the first fragment is the message length with
+   FRAG_FIRST set, that of the others their byte offset in the message. */
+#define  FRAGHDR         4
+#define  FRAGDATA        (20 - FRAGHDR)
+#define  FRAG_FIRST      0x80000000u
+
+/* generation times of the messages a sender has accepted but not yet
+   delivered, oldest first.  Both protocols deliver in order, so the
+   message delivered next is always the one at the head. */
+struct timefifo {
+  double *t;        /* ring of 2^n entries, grown when full */
+  size_t head;      /* index of the oldest entry */
+  size_t count;     /* entries in use */
+  size_t size;      /* allocated entries, a power of two */
+};
+
+/* a variable-size message generated at an end of a flow and not yet
+   handed to its entity in full */
+struct pending {
+  double since;              /* when it was generated */
+  uint32_t len;              /* its length in bytes */
+  char letter;               /* every byte of it */
+};
+
+/* one end of a flow.  Entity 2f is the A end of flow f, 2f+1 the B end,
+   so the entity at the other end of e is e ^ 1. */
+struct endpoint {
+  struct event *timer;       /* pending TIMER_INTERRUPT, NULL if the timer is not running */
+  struct timefifo inflight;  /* generation times of the messages on their way from here */
+  long long delivered;       /* messages delivered to layer 5 here */
+  char *reasm;               /* message being reassembled here, NULL until the first arrives */
+  uint32_t reasmlen;         /* its length, 0 if none is in progress */
+  uint32_t reasmgot;         /* bytes of it received so far */
+  struct pending *pending;   /* ring of messages waiting to be segmented here */
+  int pendhead, pendcount;   /* index of the oldest, and how many there are */
+  uint32_t segoff;           /* bytes of the oldest already handed to the entity */
+};
+
+/* state of one xoshiro256** generator */
+struct randstream {
+  uint64_t s[4];
+};
+
+/* everything one simulation needs.  Nothing in this file keeps state
+   outside of this structure. */
+struct sim {
+  struct sim_params params;  /* what the user asked for */
+  struct sim_stats stats;    /* counters reported at termination */
+  double time;               /* current simulated time */
+  struct randstream rand[NRANDSTREAMS];  /* this simulation's random streams */
+
+  /* the event list is kept as a binary min-heap ordered on evtime.  Events
+     with equal times come out newest first, which is the order the original
+     sorted linked list produced (a new event was inserted in front of any
+     event already scheduled for the same time). */
+  struct event **evheap;     /* the event heap */
+  int evcount;               /* number of events in the heap */
+  int evcapacity;            /* allocated size of evheap */
+  uint64_t evseqnext;        /* sequence number for next insert */
+
+  struct evchunk *evchunks;  /* every chunk allocated so far */
+  struct event *evfreelist;  /* records ready for reuse */
+  int evinuse;               /* records handed out */
+
+  int nflows;                /* sender/receiver pairs */
+  int flow;                  /* flow whose entities the protocol code is running for */
+  struct endpoint *ends;     /* both ends of every flow, 2 * nflows */
+  struct pending *pending;   /* every end's pending ring, pendlimit entries each */
+  int pendlimit;             /* messages an end holds, 1 + params.backlog */
+
+  /* latest arrival time scheduled on the channel towards A and towards B,
+     shared by all flows */
+  double channeltail[2];
+
+  /* the link model, used when params.bandwidth > 0.  Indexed by the
+     sending side and shared by all flows: the times the packets held
+     by the link from A (from B) finish transmission, in order, and
+     when the last change to the number held was accounted for in
+     stats.queue_area. */
+  struct timefifo linkq[2];
+  double linklast[2];
+
+  struct tracer *tracer;     /* binary trace, NULL if not tracing */
+
+  char *protocol;            /* state blocks owned by the protocol code, one per flow */
+  size_t protocolsize;       /* bytes from one flow's block to the next */
+};
+
+/* append a record to the binary trace, if there is one */
+static void tracerec(struct sim *s, int type, int entity, const struct pkt *p, int verdict)
+{
+  if (s->tracer != NULL)
+    tracer_put(s->tracer, s->time, type, entity & 1, entity >> 1,
+               p ? p->seqnum : -1, p ? p->acknum : -1, verdict);
+}
+
+/* the entity A or B of the flow being simulated */
+static int entityof(const struct sim *s, int AorB)
+{
+  return 2*s->flow + AorB;
+}
+
+/* splitmix64, used only to expand a seed into generator state */
+static uint64_t splitmix64(uint64_t *x)
+{
+  uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+static uint64_t rotl(uint64_t x, int k)
+{
+  return (x << k) | (x >> (64 - k));
+}
+
+/* xoshiro256** (Blackman and Vigna) */
+static uint64_t nextrand(struct randstream *r)
+{
+  uint64_t *st = r->s;
+  uint64_t result = rotl(st[1] * 5, 7) * 9;
+  uint64_t t = st[1] << 17;
+
+  st[2] ^= st[0];
+  st[3] ^= st[1];
+  st[1] ^= st[2];
+  st[0] ^= st[3];
+  st[2] ^= t;
+  st[3] = rotl(st[3], 45);
+  return result;
+}
+
+/* give every stream its own state derived from the seed */
+static void seedrand(struct sim *s, uint64_t seed)
+{
+  uint64_t x;
+  int i, j;
+
+  for (i=0; i<NRANDSTREAMS; i++) {
+    x = seed ^ ((uint64_t)(i + 1) << 56);
+    for (j=0; j<4; j++)
+      s->rand[i].s[j] = splitmix64(&x);
+  }
+}
 
 /****************************************************************************/
-/* jimsrand(): return a double in range [0,1].  The routine below is used to */
-/* isolate all random number generation in one location.  We assume that the*/
-/* system-supplied rand() function return an int in therange [0,mmm]        */
+/* jimsrand(): return a double in range [0,1).  The routine below is used to */
+/* isolate all random number generation in one location.  Each kind of      */
+/* decision draws from its own stream of the simulation.                    */
 /****************************************************************************/
-double jimsrand(void) 
+double jimsrand(struct sim *s, int stream) 
 {
-  double mmm = RAND_MAX;     /* largest int  - MACHINE DEPENDENT!!!!!!!!   */
   double x;                   
-  x = rand()/mmm;            /* x should be uniform in [0,1] */
-  if (TRACE > 3)
+  x = (nextrand(&s->rand[stream]) >> 11) * 0x1.0p-53;  /* top 53 bits, uniform in [0,1) */
+  if (TRACE_GT(s, 3))
     printf("RANDOM NUMBER GENERAION CALLED: %f\n", x);
   return(x);
 }  
 
+/********************* MEMORY ROUTINES *******/
+
+/* every allocation a simulation makes goes through simrealloc() so the
+   number of heap calls and the bytes held can be reported */
+static void *simrealloc(struct sim *s, void *old, size_t oldsize, size_t newsize)
+{
+  void *p = realloc(old, newsize);
+
+  if (p == NULL) {
+    printf("memory allocation failed.");
+    exit(EXIT_FAILURE);
+  }
+  s->stats.allocs++;
+  s->stats.bytes += (long long)newsize - (long long)oldsize;
+  if (s->stats.bytes > s->stats.peak_bytes)
+    s->stats.peak_bytes = s->stats.bytes;
+  return p;
+}
+
+static void simfree(struct sim *s, void *p, size_t size)
+{
+  free(p);
+  s->stats.bytes -= size;
+}
+
+/********************* LATENCY ROUTINES *******/
+
+static void fifo_push(struct sim *s, struct timefifo *f, double t)
+{
+  double *bigger;
+  size_t i, newsize;
+
+  if (f->count == f->size) {
+    /* grows by doubling, so this happens only while the window of
+       undelivered messages is reaching its peak */
+    newsize = f->size ? 2*f->size : 64;
+    bigger = simrealloc(s, NULL, 0, newsize * sizeof(double));
+    for (i=0; i<f->count; i++)
+      bigger[i] = f->t[(f->head + i) & (f->size - 1)];
+    simfree(s, f->t, f->size * sizeof(double));
+    f->t = bigger;
+    f->head = 0;
+    f->size = newsize;
+  }
+  f->t[(f->head + f->count) & (f->size - 1)] = t;
+  f->count++;
+}
+
+/* oldest entry, or a negative time if there is none */
+static double fifo_pop(struct timefifo *f)
+{
+  double t;
+
+  if (f->count == 0)
+    return -1.0;
+  t = f->t[f->head];
+  f->head = (f->head + 1) & (f->size - 1);
+  f->count--;
+  return t;
+}
+
+/********************* LINK ROUTINES *******/
+
+/* retire the packets the link from AorB has finished transmitting by
+   time t, integrating the number it held over time */
+static void link_drain(struct sim *s, int AorB, double t)
+{
+  struct timefifo *q = &s->linkq[AorB];
+  double done;
+
+  while (q->count > 0 && (done = q->t[q->head]) <= t) {
+    s->stats.queue_area[AorB] += q->count * (done - s->linklast[AorB]);
+    s->linklast[AorB] = done;
+    fifo_pop(q);
+  }
+  s->stats.queue_area[AorB] += q->count * (t - s->linklast[AorB]);
+  s->linklast[AorB] = t;
+}
+
+/* queue a packet on the link from AorB.  Returns the time it finishes
+   transmission, or a negative time if the queue is full and it is
+   dropped. */
+static double link_enqueue(struct sim *s, int AorB)
+{
+  struct timefifo *q = &s->linkq[AorB];
+  double start, done;
+
+  link_drain(s, AorB, s->time);
+  if (s->params.queuelimit > 0 && q->count >= (size_t)s->params.queuelimit) {
+    s->stats.queue_drops[AorB]++;
+    return -1.0;
+  }
+  /* transmission starts once the link has sent everything ahead of it */
+  start = q->count > 0 ? q->t[(q->head + q->count - 1) & (q->size - 1)] : s->time;
+  done = start + 1.0 / s->params.bandwidth;
+  fifo_push(s, q, done);
+  s->stats.link_busy[AorB] += done - start;
+  if ((int)q->count > s->stats.queue_max[AorB])
+    s->stats.queue_max[AorB] = (int)q->count;
+  return done;
+}
+
 /********************* EVENT HANDLINE ROUTINES *******/
 /*  The next set of routines handle the event list   */
 /*****************************************************/
 
-void insertevent(struct event *p)
+/* take an event record from the pool, growing it if it is empty */
+static struct event *allocevent(struct sim *s)
 {
-  struct event *q,*qold;
+  struct evchunk *c;
+  struct event *p;
+  int i;
 
-  if (TRACE>2) {
-    printf("            INSERTEVENT: time is %f\n",time);
-    printf("            INSERTEVENT: future time will be %f\n",p->evtime); 
+  if (s->evfreelist == NULL) {
+    c = simrealloc(s, NULL, 0, sizeof(struct evchunk));
+    c->next = s->evchunks;
+    s->evchunks = c;
+    s->stats.evpool_chunks++;
+    for (i=EVPOOLCHUNK-1; i>=0; i--) {
+      c->ev[i].nextfree = s->evfreelist;
+      s->evfreelist = &c->ev[i];
+    }
   }
-  q = evlist;     /* q points to front of list in which p struct inserted */
-  if (q==NULL) {   /* list is empty */
-    evlist=p;
-    p->next=NULL;
-    p->prev=NULL;
+  p = s->evfreelist;
+  s->evfreelist = p->nextfree;
+  p->pktptr = NULL;
+  if (++s->evinuse > s->stats.evpool_highwater)
+    s->stats.evpool_highwater = s->evinuse;
+  return p;
+}
+
+/* return an event record (and any packet stored in it) to the pool */
+static void freeevent(struct sim *s, struct event *p)
+{
+  p->nextfree = s->evfreelist;
+  s->evfreelist = p;
+  s->evinuse--;
+}
+
+/* returns true if event p must be simulated before event q */
+static int evbefore(const struct event *p, const struct event *q)
+{
+  if (p->evtime != q->evtime)
+    return p->evtime < q->evtime;
+  return p->evseq > q->evseq;
+}
+
+static void evplace(struct sim *s, struct event *p, int pos)
+{
+  s->evheap[pos] = p;
+  p->heappos = pos;
+}
+
+static void evsiftup(struct sim *s, int pos)
+{
+  struct event *p = s->evheap[pos];
+  int parent;
+
+  while (pos > 0) {
+    parent = (pos - 1) / 2;
+    if (!evbefore(p, s->evheap[parent]))
+      break;
+    evplace(s, s->evheap[parent], pos);
+    pos = parent;
   }
-  else {
-    for (qold = q; q !=NULL && p->evtime > q->evtime; q=q->next)
-      qold=q; 
-    if (q==NULL) {   /* end of list */
-      qold->next = p;
-      p->prev = qold;
-      p->next = NULL;
-    }
-    else if (q==evlist) { /* front of list */
-      p->next=evlist;
-      p->prev=NULL;
-      p->next->prev=p;
-      evlist = p;
-    }
-    else {     /* middle of list */
-      p->next=q;
-      p->prev=q->prev;
-      q->prev->next=p;
-      q->prev=p;
-    }
+  evplace(s, p, pos);
+}
+
+static void evsiftdown(struct sim *s, int pos)
+{
+  struct event *p = s->evheap[pos];
+  int child;
+
+  while ((child = 2*pos + 1) < s->evcount) {
+    if (child+1 < s->evcount && evbefore(s->evheap[child+1], s->evheap[child]))
+      child++;
+    if (!evbefore(s->evheap[child], p))
+      break;
+    evplace(s, s->evheap[child], pos);
+    pos = child;
   }
+  evplace(s, p, pos);
 }
 
-void generate_next_arrival(void)
+void insertevent(struct sim *s, struct event *p)
+{
+  if (TRACE_GT(s, 2)) {
+    printf("            INSERTEVENT: time is %f\n",s->time);
+    printf("            INSERTEVENT: future time will be %f\n",p->evtime); 
+  }
+  if (s->evcount == s->evcapacity) {
+    s->evheap = simrealloc(s, s->evheap, s->evcapacity * sizeof(struct event *),
+                           (s->evcapacity ? 2*s->evcapacity : 64) * sizeof(struct event *));
+    s->evcapacity = s->evcapacity ? 2*s->evcapacity : 64;
+  }
+  p->evseq = s->evseqnext++;
+  s->evheap[s->evcount++] = p;
+  evsiftup(s, s->evcount-1);
+}
+
+/* unlink event p from the event list, wherever it is in the heap */
+static void removeevent(struct sim *s, struct event *p)
+{
+  int pos = p->heappos;
+  struct event *last = s->evheap[--s->evcount];
+
+  if (last == p)
+    return;
+  evplace(s, last, pos);
+  if (pos > 0 && evbefore(last, s->evheap[(pos - 1) / 2]))
+    evsiftup(s, pos);
+  else
+    evsiftdown(s, pos);
+}
+
+/* remove and return the next event to simulate, NULL if none are left */
+static struct event *nextevent(struct sim *s)
+{
+  struct event *p;
+
+  if (s->evcount == 0)
+    return NULL;
+  p = s->evheap[0];
+  removeevent(s, p);
+  return p;
+}
+
+/* schedule the next message of a flow */
+void generate_next_arrival(struct sim *s, int flow)
 {
   double x;
   struct event *evptr;
 
-  if (TRACE>2)
+  if (TRACE_GT(s, 2))
     printf("          GENERATE NEXT ARRIVAL: creating new arrival\n");
  
-  x = lambda*jimsrand()*2;  /* x is uniform on [0,2*lambda] */
+  x = s->params.lambda*jimsrand(s, RAND_ARRIVAL)*2;  /* x is uniform on [0,2*lambda] */
   /* having mean of lambda        */
-  evptr = malloc(sizeof(struct event));
-  if (evptr == 0) {
-    printf("memory allocation for event failed.");
-    exit(EXIT_FAILURE);
-  }
-  evptr->evtime =  time + x;
+  evptr = allocevent(s);
+  evptr->evtime =  s->time + x;
   evptr->evtype =  FROM_LAYER5;
-  if (BIDIRECTIONAL && (jimsrand()>0.5) )
-    evptr->eventity = B;
+  if (s->params.bidirectional && (jimsrand(s, RAND_ARRIVAL)>0.5) )
+    evptr->eventity = 2*flow + B;
   else
-    evptr->eventity = A;
-  insertevent(evptr);
+    evptr->eventity = 2*flow + A;
+  insertevent(s, evptr);
 } 
 
-void printevlist(void)
+void printevlist(struct sim *s)
 {
-  struct event *q;
-  printf("--------------\nEvent List Follows:\n");
-  for(q = evlist; q!=NULL; q=q->next) {
-    printf("Event time: %f, type: %d entity: %d\n",q->evtime,q->evtype,q->eventity);
+  int i;
+  printf("--------------\nEvent List Follows (heap order):\n");
+  for(i = 0; i < s->evcount; i++) {
+    printf("Event time: %f, type: %d entity: %d\n",s->evheap[i]->evtime,s->evheap[i]->evtype,s->evheap[i]->eventity);
   }
   printf("--------------\n");
 }
 
-void init(void)                         /* initialize the simulator */
+/********************** Simulation context ROUTINES ***********************/
+
+/* fill in the parameters used when the caller does not set them */
+void sim_defaults(struct sim_params *p)
+{
+  memset(p, 0, sizeof(*p));
+  p->nsimmax = 1000;
+  p->lambda = 10.0;
+  p->corruptdirection = 2;
+  p->trace = 0;
+  p->seed = 9999;
+  p->ackdelay = 4.0;
+  p->propdelay = 5.0;
+  p->queuelimit = 64;
+}
+
+/* create a simulation ready to run.  Returns NULL if it can't be set up. */
+struct sim *sim_create(const struct sim_params *params)
 {
-  float sum, avg;
+  struct sim *s;
+  size_t ends;
+  int f, i;
+
+  s = calloc(1, sizeof(struct sim));
+  if (s == NULL)
+    return NULL;
+  s->params = *params;
+
+  seedrand(s, params->seed);   /* init random number generator */
+
+  s->time=0.0;                 /* initialize time to 0.0 */
+  s->channeltail[A] = s->channeltail[B] = 0.0;
+  s->nflows = params->flows > 1 ? params->flows : 1;
+  ends = 2 * (size_t)s->nflows * sizeof(struct endpoint);
+  s->ends = simrealloc(s, NULL, 0, ends);
+  memset(s->ends, 0, ends);
+  if (params->msgsize > 0) {
+    s->pendlimit = 1 + (params->backlog > 0 ? params->backlog : 0);
+    s->pending = simrealloc(s, NULL, 0, 2 * (size_t)s->nflows * s->pendlimit * sizeof(struct pending));
+    for (i = 0; i < 2 * s->nflows; i++)
+      s->ends[i].pending = s->pending + (size_t)i * s->pendlimit;
+  }
+  hist_init(&s->stats.latency);
+  hist_init(&s->stats.backlog_delay);
+  if (params->tracefile != NULL) {
+    s->tracer = tracer_open(params->tracefile);
+    if (s->tracer == NULL) {
+      sim_destroy(s);     /* copes with a simulation built part way */
+      return NULL;
+    }
+  }
+  for (f = 0; f < s->nflows; f++)
+    generate_next_arrival(s, f);    /* initialize event list */
+
+  for (f = 0; f < s->nflows; f++) {
+    s->flow = f;
+    A_init(s);
+    B_init(s);
+  }
+  return s;
+}
+
+/* release everything owned by a simulation */
+void sim_destroy(struct sim *s)
+{
+  struct evchunk *c, *next;
   int i;
 
-  printf("-----  Stop and Wait Network Simulator Version 1.1 -------- \n\n");
-  printf("Enter the number of messages to simulate: ");
-  scanf("%d",&nsimmax);
-  printf("Enter  packet loss probability [enter 0.0 for no loss]:");
-  scanf("%f",&lossprob);
-  printf("Enter packet corruption probability [0.0 for no corruption]:");
-  scanf("%f",&corruptprob);
-  if (lossprob != 0.0 || corruptprob != 0.0) {
-    printf("If you want loss or corruption to only occur in one direction, choose the direction: 0 A->B, 1 A<-B, 2 A<->B (both directions) :");
-    scanf("%d",&corruptdirection);
+  if (s == NULL)
+    return;
+  tracer_close(s->tracer);
+  for (c = s->evchunks; c != NULL; c = next) {
+    next = c->next;
+    free(c);
   }
-  printf("Enter average time between messages from sender's layer5 [ > 0.0]:");
-  scanf("%f",&lambda);
-  printf("Enter TRACE:");
-  scanf("%d",&TRACE);
-
-
-  srand(9999);              /* init random number generator */
-  sum = 0.0;                /* test random number generator for students */
-  for (i=0; i<1000; i++)
-    sum+=jimsrand();    /* jimsrand() should be uniform in [0,1] */
-  avg = sum/1000.0;
-  if (avg < 0.25 || avg > 0.75) {
-    printf("It is likely that random number generation on your machine\n" ); 
-    printf("is different from what this emulator expects.  Please take\n");
-    printf("a look at the routine jimsrand() in the emulator code. Sorry. \n");
-    exit(EXIT_FAILURE);
+  free(s->evheap);
+  for (i = 0; i < 2*s->nflows; i++) {
+    free(s->ends[i].inflight.t);
+    free(s->ends[i].reasm);
   }
+  free(s->ends);
+  free(s->pending);
+  free(s->linkq[A].t);
+  free(s->linkq[B].t);
+  free(s->protocol);
+  free(s);
+}
 
-  /* initialise statistics */
-  window_full = 0;
-  total_ACKs_received = 0;
-  packets_resent = 0;
-  new_ACKs = 0;
-  packets_received = 0;
-  packets_lost = 0;  
-  packets_corrupt = 0;
-  packets_sent = 0;
-  packets_timeout = 0;
-  messages_delivered = 0;
+/* counters the protocol code updates */
+struct sim_stats *sim_stats(struct sim *s)
+{
+  return &s->stats;
+}
 
-  ntolayer3 = 0;
-  nlost = 0;
-  ncorrupt = 0;
+/* results of a simulation, complete once sim_run() has returned */
+const struct sim_stats *sim_results(const struct sim *s)
+{
+  return &s->stats;
+}
 
-  time=0.0;                    /* initialize time to 0.0 */
-  generate_next_arrival();     /* initialize event list */
+const struct sim_params *sim_config(const struct sim *s)
+{
+  return &s->params;
+}
+
+double sim_time(const struct sim *s)
+{
+  return s->time;
+}
+
+int sim_trace(const struct sim *s)
+{
+  return s->params.trace;
+}
+
+/* the protocol's state block for the flow being simulated.  The first
+   call allocates a block of size bytes, zero filled, for every flow at
+   once; size is ignored after that.  The blocks are freed by
+   sim_destroy(). */
+void *sim_protocol_state(struct sim *s, size_t size)
+{
+  if (s->protocol == NULL) {
+    s->protocolsize = (size + 15) & ~(size_t)15;   /* keep every block aligned */
+    s->protocol = simrealloc(s, NULL, 0, s->nflows * s->protocolsize);
+    memset(s->protocol, 0, s->nflows * s->protocolsize);
+  }
+  return s->protocol + s->flow * s->protocolsize;
 }
 
 /********************** Student-callable ROUTINES ***********************/
 
 /* called by students routine to cancel a previously-started timer */
-void stoptimer(int AorB)
+void stoptimer(struct sim *s, int AorB)
 /* A or B is trying to stop timer */
 {
-  struct event *q;
-
-  if (TRACE>1)
-    printf("          STOP TIMER: stopping timer at %f\n",time);
-  /* for (q=evlist; q!=NULL && q->next!=NULL; q = q->next)  */
-  for (q=evlist; q!=NULL ; q = q->next) 
-    if ( (q->evtype==TIMER_INTERRUPT  && q->eventity==AorB) ) { 
-      /* remove this event */
-      if (q->next==NULL && q->prev==NULL)
-        evlist=NULL;         /* remove first and only event on list */
-      else if (q->next==NULL) /* end of list - there is one in front */
-        q->prev->next = NULL;
-      else if (q==evlist) { /* front of list - there must be event after */
-        q->next->prev=NULL;
-        evlist = q->next;
-      }
-      else {     /* middle of list */
-        q->next->prev = q->prev;
-        q->prev->next =  q->next;
-      }
-      free(q);
-      return;
-    }
-  printf("Warning: unable to cancel your timer. It wasn't running.\n");
+  struct endpoint *end = &s->ends[entityof(s, AorB)];
+
+  if (TRACE_GT(s, 1))
+    printf("          STOP TIMER: stopping timer at %f\n",s->time);
+  if (end->timer == NULL) {
+    printf("Warning: unable to cancel your timer. It wasn't running.\n");
+    return;
+  }
+  /* leave the event in the heap, the main loop throws it away when it */
+  /* comes up.  This keeps cancelling a timer constant time. */
+  end->timer->evtype = TIMER_CANCELLED;
+  end->timer = NULL;
+  tracerec(s, TR_TIMERSTOP, entityof(s, AorB), NULL, TV_NONE);
 }
 
 
-void starttimer(int AorB, double increment)
+void starttimer(struct sim *s, int AorB, double increment)
 /* A or B is trying to start timer */
 {
-
-  struct event *q;
+  struct endpoint *end = &s->ends[entityof(s, AorB)];
   struct event *evptr;
 
-  if (TRACE>1)
-    printf("          START TIMER: starting timer at %f\n",time);
+  if (TRACE_GT(s, 1))
+    printf("          START TIMER: starting timer at %f\n",s->time);
   /* be nice: check to see if timer is already started, if so, then  warn */
-  /* for (q=evlist; q!=NULL && q->next!=NULL; q = q->next)  */
-  for (q=evlist; q!=NULL ; q = q->next)  
-    if ( (q->evtype==TIMER_INTERRUPT  && q->eventity==AorB) ) { 
-      printf("Warning: attempt to start a timer that is already started\n");
-      return;
-    }
+  if (end->timer != NULL) {
+    printf("Warning: attempt to start a timer that is already started\n");
+    return;
+  }
  
   /* create future event for when timer goes off */
-  evptr = malloc(sizeof(struct event));
-  if (evptr == 0) {
-    printf("memory allocation for event failed.");
-    exit(EXIT_FAILURE);
-  }
-  evptr->evtime =  time + increment;
+  evptr = allocevent(s);
+  evptr->evtime =  s->time + increment;
   evptr->evtype =  TIMER_INTERRUPT;
    
  
-  evptr->eventity = AorB;
-  insertevent(evptr);
+  evptr->eventity = entityof(s, AorB);
+  insertevent(s, evptr);
+  end->timer = evptr;
+  tracerec(s, TR_TIMERSTART, evptr->eventity, NULL, TV_NONE);
 } 
 
 
 /************************** TOLAYER3 ***************/
-void tolayer3(int AorB, struct pkt packet)
+void tolayer3_ptr(struct sim *s, int AorB, const struct pkt *packet)
 /* A or B is sending to network  */
 {
   struct pkt *mypktptr;
-  struct event *evptr,*q;
-  float lastime, x;
+  struct event *evptr;
+  double lastime, x, done = 0.0;
   int i;
+  int corruptdirection = s->params.corruptdirection;
+  int entity = entityof(s, AorB);
 
-  ntolayer3++;
+  s->stats.ntolayer3++;
+  s->stats.sent[AorB]++;
+
+  /* with the link model the packet first has to get into the link's queue */
+  if (s->params.bandwidth > 0.0 && (done = link_enqueue(s, AorB)) < 0.0) {
+    tracerec(s, TR_SEND, entity, packet, TV_OVERFLOW);
+    if (TRACE_GT(s, 0))
+      printf("          TOLAYER3: packet dropped, link queue full\n");
+    return;
+  }
 
   /* simulate losses: */
-  if (jimsrand() < lossprob && (!(AorB == B && corruptdirection == A) && !(AorB == A && corruptdirection == B))) {
-    nlost++;
-    if (TRACE>0)    
+  if (jimsrand(s, RAND_LOSS) < s->params.lossprob && (!(AorB == B && corruptdirection == A) && !(AorB == A && corruptdirection == B))) {
+    s->stats.nlost++;
+    tracerec(s, TR_SEND, entity, packet, TV_LOST);
+    if (TRACE_GT(s, 0))    
       printf("          TOLAYER3: packet being lost\n");
     return;
   }  
 
+  /* create future event for arrival of packet at the other side */
+  evptr = allocevent(s);
+
   /* make a copy of the packet student just gave me since he/she may decide */
-  /* to do something with the packet after we return back to him/her */ 
-  mypktptr = malloc(sizeof(struct pkt));
-  if (mypktptr == 0) {
-    printf("memory allocation for event failed.");
-    exit(EXIT_FAILURE);
-  }
-  mypktptr->seqnum = packet.seqnum;
-  mypktptr->acknum = packet.acknum;
-  mypktptr->checksum = packet.checksum;
-  for (i=0; i<20; i++)
-    mypktptr->payload[i] = packet.payload[i];
-  if (TRACE>2)  {
+  /* to do something with the packet after we return back to him/her.  It */
+  /* is the only copy: the receiver is handed a pointer to this one. */
+  mypktptr = &evptr->pkt;
+  *mypktptr = *packet;
+  if (TRACE_GT(s, 2))  {
     printf("          TOLAYER3: seq: %d, ack %d, check: %d ", mypktptr->seqnum,
            mypktptr->acknum,  mypktptr->checksum);
     for (i=0; i<20; i++)
@@ -333,50 +776,112 @@ void tolayer3(int AorB, struct pkt packet)
     printf("\n");
   }
 
-  /* create future event for arrival of packet at the other side */
-  evptr = malloc(sizeof(struct event));
-  if (evptr == 0) {
-    printf("memory allocation for event failed.");
-    exit(EXIT_FAILURE);
-  }
   evptr->evtype =  FROM_LAYER3;   /* packet will pop out from layer3 */
-  evptr->eventity = (AorB+1) % 2; /* event occurs at other entity */
+  evptr->eventity = entity ^ 1;   /* event occurs at other end of the flow */
   evptr->pktptr = mypktptr;       /* save ptr to my copy of packet */
   /* finally, compute the arrival time of packet at the other end.
      medium can not reorder, so make sure packet arrives between 1 and 10
      time units after the latest arrival time of packets
-     currently in the medium on their way to the destination */
-  lastime = time;
-  /* for (q=evlist; q!=NULL && q->next!=NULL; q = q->next) */
-  for (q=evlist; q!=NULL ; q = q->next) 
-    if ( (q->evtype==FROM_LAYER3  && q->eventity==evptr->eventity) ) 
-      lastime = q->evtime;
-  evptr->evtime =  lastime + 1 + 9*jimsrand();
+     currently in the medium on their way to the destination side, of
+     any flow.  With the link model it arrives one propagation delay after
+     it has been transmitted, which keeps the order too. */
+  if (s->params.bandwidth > 0.0)
+    evptr->evtime = done + s->params.propdelay;
+  else {
+    lastime = s->channeltail[AorB ^ 1];
+    if (lastime < s->time)       /* everything in flight has been delivered */
+      lastime = s->time;
+    evptr->evtime =  lastime + 1 + 9*jimsrand(s, RAND_DELAY);
+  }
+  s->channeltail[AorB ^ 1] = evptr->evtime;
  
 
 
   /* simulate corruption: */
-  if ((jimsrand() < corruptprob)  && (!(AorB == B && corruptdirection == A) && !(AorB == A && corruptdirection == B))) {
-    ncorrupt++;
-    if ( (x = jimsrand()) < .75)
+  if ((jimsrand(s, RAND_CORRUPT) < s->params.corruptprob)  && (!(AorB == B && corruptdirection == A) && !(AorB == A && corruptdirection == B))) {
+    s->stats.ncorrupt++;
+    tracerec(s, TR_SEND, entity, packet, TV_CORRUPTED);
+    if ( (x = jimsrand(s, RAND_CORRUPT)) < .75)
       mypktptr->payload[0]='Z';   /* corrupt payload */
     else if (x < .875)
       mypktptr->seqnum = 999999;
     else
       mypktptr->acknum = 999999;
-    if (TRACE>0)    
+    if (TRACE_GT(s, 0))    
       printf("          TOLAYER3: packet being corrupted\n");
   }  
+  else
+    tracerec(s, TR_SEND, entity, packet, TV_SCHEDULED);
 
-  if (TRACE>2)  
+  if (TRACE_GT(s, 2))  
     printf("          TOLAYER3: scheduling arrival on other side\n");
-  insertevent(evptr);
+  insertevent(s, evptr);
 } 
 
-void tolayer5(int AorB, char datasent[20])
+/* by-value form of tolayer3_ptr, for code written against the original API */
+void tolayer3(struct sim *s, int AorB, struct pkt packet)
+{
+  tolayer3_ptr(s, AorB, &packet);
+}
+
+/* largest message the application generates */
+static uint32_t msgsizemax(const struct sim *s)
+{
+  return (uint32_t)(s->params.msgsizemax > s->params.msgsize ? s->params.msgsizemax
+                                                              : s->params.msgsize);
+}
+
+/* add a fragment to the message being reassembled at entity.  The data
+   is copied once, from the packet straight to its place in the buffer,
+   which is allocated at the largest message size the first time it is
+   needed.  A fragment whose header doesn't fit the message under way,
+   which a corrupted packet that got past the checksum or a protocol bug
+   could deliver, is dropped and counted in stats.fragments_rejected.
+   Returns the message length once it is complete, 0 until then. */
+static uint32_t reassemble(struct sim *s, int entity, const char data[20])
+{
+  struct endpoint *end = &s->ends[entity];
+  const unsigned char *h = (const unsigned char *)data;
+  uint32_t hdr = (uint32_t)h[0] << 24 | (uint32_t)h[1] << 16 | (uint32_t)h[2] << 8 | h[3];
+  uint32_t n, len;
+
+  if (hdr & FRAG_FIRST) {
+    len = hdr & ~FRAG_FIRST;
+    if (len == 0 || len > msgsizemax(s)) {
+      s->stats.fragments_rejected++;
+      return 0;
+    }
+    if (end->reasm == NULL)
+      end->reasm = simrealloc(s, NULL, 0, msgsizemax(s));
+    end->reasmlen = len;
+    end->reasmgot = 0;
+  }
+  /* not the fragment expected next: no message under way, or the wrong
+     offset into it */
+  else if (hdr != end->reasmgot || hdr >= end->reasmlen) {
+    s->stats.fragments_rejected++;
+    return 0;
+  }
+
+  /* reasmgot < reasmlen here, so the copy stays inside the message */
+  n = end->reasmlen - end->reasmgot < FRAGDATA ? end->reasmlen - end->reasmgot : FRAGDATA;
+  memcpy(end->reasm + end->reasmgot, data + FRAGHDR, n);
+  end->reasmgot += n;
+  if (end->reasmgot < end->reasmlen)
+    return 0;
+  len = end->reasmlen;
+  end->reasmlen = 0;
+  return len;
+}
+
+void tolayer5(struct sim *s, int AorB, const char datasent[20])
 {
   int i;  
-  if (TRACE>2) {
+  double generated;
+  int entity = entityof(s, AorB);
+  uint32_t len;
+
+  if (TRACE_GT(s, 2)) {
     printf("          TOLAYER5: data received by application at ");
     if (AorB == A) 
       printf("A: ");
@@ -386,29 +891,137 @@ void tolayer5(int AorB, char datasent[20])
       printf("%c",datasent[i]);
     printf("\n");
   }
-  messages_delivered++;
+  /* a variable-size message is delivered once its last fragment is in */
+  if (s->params.msgsize > 0) {
+    len = reassemble(s, entity, datasent);
+    if (len == 0)
+      return;
+    s->stats.bytes_delivered += len;
+  }
+  s->stats.messages_delivered++;
+  s->stats.delivered[AorB]++;
+  s->ends[entity].delivered++;
+  tracerec(s, TR_DELIVER, entity, NULL, TV_DELIVERED);
+
+  /* the message was generated at the other end of the flow */
+  generated = fifo_pop(&s->ends[entity ^ 1].inflight);
+  if (generated >= 0.0)
+    hist_record(&s->stats.latency, s->time - generated);
+}
+
+/* Jain's fairness index of the flows' goodput, (sum x)^2 / (n sum x^2),
+   and the least and most any flow got */
+static void flow_fairness(struct sim *s)
+{
+  double x, sum = 0.0, sum2 = 0.0, lo = 0.0, hi = 0.0;
+  int f;
+
+  for (f = 0; f < s->nflows; f++) {
+    x = s->time > 0 ? (s->ends[2*f].delivered + s->ends[2*f+1].delivered) / s->time : 0.0;
+    sum += x;
+    sum2 += x * x;
+    if (f == 0 || x < lo)
+      lo = x;
+    if (f == 0 || x > hi)
+      hi = x;
+  }
+  s->stats.fairness = sum2 > 0 ? sum * sum / (s->nflows * sum2) : 0.0;
+  s->stats.flow_goodput_min = lo;
+  s->stats.flow_goodput_max = hi;
+}
+
+/* queue a message of msgsize..msgsizemax bytes, every byte the letter,
+   at entity.  An end holds up to pendlimit messages: the one being
+   segmented, and behind it a backlog of params.backlog.  A message that
+   finds them all taken is dropped, and counted as the fixed-size message
+   would be when the sender refuses it.  Returns false if it was. */
+static int queue_message(struct sim *s, int entity, char letter)
+{
+  struct endpoint *end = &s->ends[entity];
+  struct pending *m;
+  uint32_t len;
+
+  len = (uint32_t)s->params.msgsize;
+  if (msgsizemax(s) > len)
+    len += (uint32_t)(jimsrand(s, RAND_SIZE) * (msgsizemax(s) - len + 1));
+  if (end->pendcount >= s->pendlimit) {
+    if (TRACE_GT(s, 0))
+      printf("          MAINLOOP: %d messages already waiting, message dropped\n", end->pendcount);
+    s->stats.window_full++;
+    return 0;
+  }
+  m = &end->pending[(end->pendhead + end->pendcount) % s->pendlimit];
+  m->since = s->time;
+  m->len = len;
+  m->letter = letter;
+  /* behind the message being segmented it waits in the backlog */
+  if (end->pendcount > 0) {
+    s->stats.backlogged++;
+    if (end->pendcount > s->stats.backlog_max)
+      s->stats.backlog_max = end->pendcount;
+  }
+  end->pendcount++;
+  return 1;
+}
+
+/* hand the entity the next fragments of the messages waiting at its end
+   for as long as it has room for them.  Fragments are built in place, so
+   nothing of a message is stored but its length and letter.  Called for
+   the flow being simulated whenever its window may have opened: when a
+   message is queued and when a packet arrives. */
+static void pump(struct sim *s, int entity)
+{
+  struct endpoint *end = &s->ends[entity];
+  struct pending *m;
+  struct msg frag;
+  uint32_t hdr;
+  int side = entity & 1;
+
+  while (end->pendcount > 0 && (side == A ? A_room(s) : B_room(s)) > 0) {
+    m = &end->pending[end->pendhead];
+    hdr = end->segoff == 0 ? m->len | FRAG_FIRST : end->segoff;
+    memset(frag.data, m->letter, sizeof(frag.data));
+    frag.data[0] = (char)(hdr >> 24);
+    frag.data[1] = (char)(hdr >> 16);
+    frag.data[2] = (char)(hdr >> 8);
+    frag.data[3] = (char)hdr;
+    if (side == A)
+      A_output(s, frag);
+    else
+      B_output(s, frag);
+    end->segoff += FRAGDATA;
+    if (end->segoff < m->len)
+      continue;
+
+    /* the message is all out; the next one leaves the backlog */
+    end->segoff = 0;
+    end->pendhead = (end->pendhead + 1) % s->pendlimit;
+    end->pendcount--;
+    if (end->pendcount > 0)
+      hist_record(&s->stats.backlog_delay, s->time - end->pending[end->pendhead].since);
+  }
 }
 
-int main(void)
+/* run the simulation until no events are left */
+void sim_run(struct sim *s)
 {
   struct event *eventptr;
   struct msg  msg2give;
-  struct pkt  pkt2give;
+  long long dropped;
+  int accepted;
    
-  int i,j;
+  int i,j,side;
   
-  init();
-  A_init();
-  B_init();
-   
   while (1) {
-    eventptr = evlist;            /* get next event to simulate */
+    eventptr = nextevent(s);      /* get next event to simulate */
     if (eventptr==NULL)
-      goto terminate;
-    evlist = evlist->next;        /* remove this event from event list */
-    if (evlist!=NULL)
-      evlist->prev=NULL;
-    if (TRACE>=2) {
+      break;
+    if (eventptr->evtype == TIMER_CANCELLED) {
+      freeevent(s, eventptr);
+      continue;
+    }
+    s->stats.events++;
+    if (TRACE_GT(s, 1)) {
       printf("\nEVENT time: %f,",eventptr->evtime);
       printf("  type: %d",eventptr->evtype);
       if (eventptr->evtype==0)
@@ -419,60 +1032,251 @@ int main(void)
         printf(", fromlayer3 ");
       printf(" entity: %d\n",eventptr->eventity);
     }
-    time = eventptr->evtime;        /* update time to next event time */
+    s->time = eventptr->evtime;     /* update time to next event time */
+    s->flow = eventptr->eventity >> 1;   /* the protocol code runs for this flow */
+    side = eventptr->eventity & 1;
     if (eventptr->evtype == FROM_LAYER5 ) {
-      if (nsim < nsimmax) {
-        generate_next_arrival();   /* set up future arrival */
+      if (s->stats.nsim < s->params.nsimmax) {
+        generate_next_arrival(s, s->flow);  /* set up future arrival */
         /* fill in msg to give with string of same letter */    
-        j = nsim % 26; 
+        j = s->stats.nsim % 26; 
         for (i=0; i<20; i++)  
           msg2give.data[i] = 97 + j;
-        if (TRACE>2) {
+        if (TRACE_GT(s, 2)) {
           printf("          MAINLOOP: data given to student: ");
           for (i=0; i<20; i++) 
             printf("%c", msg2give.data[i]);
           printf("\n");
         }
-        nsim++;
-        if (eventptr->eventity == A) 
-          A_output(msg2give);  
+        s->stats.nsim++;
+        if (s->params.msgsize > 0)
+          accepted = queue_message(s, eventptr->eventity, msg2give.data[0]);
+        else {
+          dropped = s->stats.window_full;
+          if (side == A) 
+            A_output(s, msg2give);  
+          else
+            B_output(s, msg2give);  
+          accepted = s->stats.window_full == dropped;
+        }
+        /* unless the sender dropped it, remember when it was generated */
+        if (accepted) {
+          fifo_push(s, &s->ends[eventptr->eventity].inflight, s->time);
+          tracerec(s, TR_GENERATE, eventptr->eventity, NULL, TV_ACCEPTED);
+        }
         else
-          B_output(msg2give);  
+          tracerec(s, TR_GENERATE, eventptr->eventity, NULL, TV_DROPPED);
+        if (s->params.msgsize > 0)
+          pump(s, eventptr->eventity);
       }
-      else if (TRACE > 2)
+      else if (TRACE_GT(s, 2))
           printf("          FROM_LAYER5: no more messages to send: \n");
     }
     else if (eventptr->evtype ==  FROM_LAYER3) {
-      pkt2give.seqnum = eventptr->pktptr->seqnum;
-      pkt2give.acknum = eventptr->pktptr->acknum;
-      pkt2give.checksum = eventptr->pktptr->checksum;
-      for (i=0; i<20; i++)  
-        pkt2give.payload[i] = eventptr->pktptr->payload[i];
-	    if (eventptr->eventity ==A)      /* deliver packet by calling */
-        A_input(pkt2give);            /* appropriate entity */
+      /* the entity reads the packet in place; the event, and the packet */
+      /* with it, goes back to the pool once the entity returns */
+      tracerec(s, TR_RECEIVE, eventptr->eventity, eventptr->pktptr, TV_NONE);
+      if (side == A)                   /* deliver packet by calling */
+        A_input_ptr(s, eventptr->pktptr);   /* appropriate entity */
       else
-        B_input(pkt2give);
-	    free(eventptr->pktptr);          /* free the memory for packet */
+        B_input_ptr(s, eventptr->pktptr);
+      /* an ACK may have made room for more of a long message */
+      if (s->params.msgsize > 0)
+        pump(s, eventptr->eventity);
     }
     else if (eventptr->evtype ==  TIMER_INTERRUPT) {
-      if (eventptr->eventity == A) 
-        A_timerinterrupt();
+      s->ends[eventptr->eventity].timer = NULL;
+      tracerec(s, TR_TIMEOUT, eventptr->eventity, NULL, TV_NONE);
+      if (side == A) 
+        A_timerinterrupt(s);
       else
-        B_timerinterrupt();
+        B_timerinterrupt(s);
     }
     else  {
       printf("INTERNAL PANIC: unknown event type \n");
     }
-    free(eventptr);
+    freeevent(s, eventptr);
   }
+  s->stats.time = s->time;
+  link_drain(s, A, s->time);
+  link_drain(s, B, s->time);
+  flow_fairness(s);
+}
+
+/* print the statistics gathered by a finished simulation */
+void sim_report(const struct sim *s)
+{
+  const struct sim_stats *st = &s->stats;
+  int i;
 
- terminate:
-  printf(" Simulator terminated at time %f\n after attempting to send %d msgs from layer5\n",time,nsim);
-  printf("number of messages dropped due to full window:  %d \n", window_full);
-  printf("number of valid (not corrupt or duplicate) acknowledgements received at A:  %d \n", new_ACKs);
+  printf(" Simulator terminated at time %f\n after attempting to send %lld msgs from layer5\n",st->time,st->nsim);
+  printf("number of messages dropped due to full window:  %lld \n", st->window_full);
+  printf("number of valid (not corrupt or duplicate) acknowledgements received at A:  %lld \n", st->new_ACKs);
   printf("(note: a single acknowledgement may have acknowledged more than one packet - if cumulative acknowledgements are used)\n");
-  printf("number of packet resends by A:  %d \n", packets_resent);
-  printf("number of correct packets received at B:  %d \n", packets_received);
-  printf("number of messages delivered to application:  %d \n", messages_delivered);
+  printf("number of packet resends by A:  %lld \n", st->packets_resent);
+  printf("number of correct packets received at B:  %lld \n", st->packets_received);
+  printf("number of messages delivered to application:  %lld \n", st->messages_delivered);
+  printf("number of spurious resends (packets B already had):  %lld \n", st->spurious_resends);
+  printf("packets sent into layer 3:  %lld by A, %lld by B (%.3f by B per message delivered)\n",
+         st->sent[A], st->sent[B],
+         st->messages_delivered ? (double)st->sent[B] / st->messages_delivered : 0.0);
+  printf("number of fast retransmits:  %lld (%lld recovered without a timeout)\n",
+         st->fast_retransmits, st->timeouts_avoided);
+  printf("goodput: %.4f messages delivered per time unit\n",
+         st->time > 0 ? st->messages_delivered / st->time : 0.0);
+  if (s->params.bidirectional)
+    printf("goodput by direction: A->B %.4f  B->A %.4f messages per time unit, %lld ACKs piggybacked\n",
+           st->time > 0 ? st->delivered[B] / st->time : 0.0,
+           st->time > 0 ? st->delivered[A] / st->time : 0.0, st->piggybacked);
+  if (s->params.msgsize > 0)
+    printf("messages of %d to %u bytes: %lld bytes delivered in whole messages, "
+           "%.3f bytes per time unit, %lld fragments rejected\n",
+           s->params.msgsize, msgsizemax(s), st->bytes_delivered,
+           st->time > 0 ? st->bytes_delivered / st->time : 0.0, st->fragments_rejected);
+  if (s->nflows > 1)
+    printf("%d flows: goodput per flow min %.6f  mean %.6f  max %.6f, Jain's fairness index %.4f\n",
+           s->nflows, st->flow_goodput_min,
+           st->time > 0 ? st->messages_delivered / st->time / s->nflows : 0.0,
+           st->flow_goodput_max, st->fairness);
+  if (s->params.backlog > 0)
+    printf("sender backlog: %lld messages waited, depth mean %.3f max %d, "
+           "delay p50 %.3f  p99 %.3f  max %.3f\n", st->backlogged,
+           st->time > 0 ? st->backlog_delay.sum / st->time / (s->params.bidirectional ? 2 : 1) / s->nflows : 0.0,
+           st->backlog_max,
+           hist_quantile(&st->backlog_delay, 0.5), hist_quantile(&st->backlog_delay, 0.99),
+           st->backlog_delay.max);
+  printf("end-to-end latency over %lld messages: p50 %.3f  p90 %.3f  p99 %.3f  p99.9 %.3f  max %.3f\n",
+         st->latency.count, hist_quantile(&st->latency, 0.5), hist_quantile(&st->latency, 0.9),
+         hist_quantile(&st->latency, 0.99), hist_quantile(&st->latency, 0.999), st->latency.max);
+  if (s->params.bandwidth > 0.0)
+    for (i = A; i <= B; i++)
+      printf("link %s: utilization %.3f, queue mean %.3f max %d packets, %lld dropped when full\n",
+             i == A ? "A->B" : "B->A", st->time > 0 ? st->link_busy[i] / st->time : 0.0,
+             st->time > 0 ? st->queue_area[i] / st->time : 0.0, st->queue_max[i],
+             st->queue_drops[i]);
+  printf("event pool: %d records in %d chunks, high-water %d events in use\n",
+         st->evpool_chunks*EVPOOLCHUNK, st->evpool_chunks, st->evpool_highwater);
+}
+
+#ifndef SIM_NO_MAIN
+
+/* ask the user for the simulation parameters */
+static void init(struct sim_params *p)
+{
+  printf("-----  Stop and Wait Network Simulator Version 1.1 -------- \n\n");
+  printf("Enter the number of messages to simulate: ");
+  scanf("%lld",&p->nsimmax);
+  printf("Enter  packet loss probability [enter 0.0 for no loss]:");
+  scanf("%lf",&p->lossprob);
+  printf("Enter packet corruption probability [0.0 for no corruption]:");
+  scanf("%lf",&p->corruptprob);
+  if (p->lossprob != 0.0 || p->corruptprob != 0.0) {
+    printf("If you want loss or corruption to only occur in one direction, choose the direction: 0 A->B, 1 A<-B, 2 A<->B (both directions) :");
+    scanf("%d",&p->corruptdirection);
+  }
+  printf("Enter average time between messages from sender's layer5 [ > 0.0]:");
+  scanf("%lf",&p->lambda);
+  printf("Enter TRACE:");
+  scanf("%d",&p->trace);
+}
+
+static void usage(const char *prog)
+{
+  fprintf(stderr, "usage: %s [--seed N] [--timeout fixed|adaptive] [--fast-retransmit N]\n"
+          "          [--window N] [--seqspace N] [--sack]\n"
+          "          [--per-packet-timers] [--delayed-ack K] [--ack-delay T]\n"
+          "          [--checksum sum|crc32c] [--bandwidth R [--prop-delay T] [--queue N]]\n"
+          "          [--backlog N] [--bidirectional] [--flows N] [--msg-size N[:M]]\n"
+          "          [--trace-file FILE]\n"
+          "          [--sweep GRID [--threads N] [--output FILE]]\n", prog);
+  fprintf(stderr, "  with no options the simulation parameters are read from stdin\n");
+}
+
+int main(int argc, char **argv)
+{
+  struct sim_params params;
+  struct sim *s;
+  const char *sweep = NULL;      /* grid to sweep, NULL for a single run */
+  const char *output = NULL;     /* where sweep results go */
+  int threads = 0;               /* sweep worker threads, 0 = one per CPU */
+  int i;
+
+  sim_defaults(&params);
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--sweep") == 0 && i+1 < argc)
+      sweep = argv[++i];
+    else if (strcmp(argv[i], "--seed") == 0 && i+1 < argc)
+      params.seed = strtoull(argv[++i], NULL, 0);
+    else if (strcmp(argv[i], "--timeout") == 0 && i+1 < argc && strcmp(argv[i+1], "fixed") == 0) {
+      params.timeout = TIMEOUT_FIXED;
+      i++;
+    }
+    else if (strcmp(argv[i], "--timeout") == 0 && i+1 < argc && strcmp(argv[i+1], "adaptive") == 0) {
+      params.timeout = TIMEOUT_ADAPTIVE;
+      i++;
+    }
+    else if (strcmp(argv[i], "--fast-retransmit") == 0 && i+1 < argc)
+      params.dupacks = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--window") == 0 && i+1 < argc)
+      params.windowsize = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--seqspace") == 0 && i+1 < argc)
+      params.seqspace = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--sack") == 0)
+      params.sack = 1;
+    else if (strcmp(argv[i], "--per-packet-timers") == 0)
+      params.pktimers = 1;
+    else if (strcmp(argv[i], "--delayed-ack") == 0 && i+1 < argc)
+      params.ackevery = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--ack-delay") == 0 && i+1 < argc)
+      params.ackdelay = atof(argv[++i]);
+    else if (strcmp(argv[i], "--checksum") == 0 && i+1 < argc && strcmp(argv[i+1], "sum") == 0) {
+      params.checksum = CKSUM_SUM;
+      i++;
+    }
+    else if (strcmp(argv[i], "--checksum") == 0 && i+1 < argc && strcmp(argv[i+1], "crc32c") == 0) {
+      params.checksum = CKSUM_CRC32C;
+      i++;
+    }
+    else if (strcmp(argv[i], "--bandwidth") == 0 && i+1 < argc)
+      params.bandwidth = atof(argv[++i]);
+    else if (strcmp(argv[i], "--prop-delay") == 0 && i+1 < argc)
+      params.propdelay = atof(argv[++i]);
+    else if (strcmp(argv[i], "--queue") == 0 && i+1 < argc)
+      params.queuelimit = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--backlog") == 0 && i+1 < argc)
+      params.backlog = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--bidirectional") == 0)
+      params.bidirectional = 1;
+    else if (strcmp(argv[i], "--flows") == 0 && i+1 < argc)
+      params.flows = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--msg-size") == 0 && i+1 < argc
+             && sscanf(argv[i+1], "%d:%d", &params.msgsize, &params.msgsizemax) >= 1
+             && params.msgsize >= 0)
+      i++;
+    else if (strcmp(argv[i], "--trace-file") == 0 && i+1 < argc)
+      params.tracefile = argv[++i];
+    else if (strcmp(argv[i], "--threads") == 0 && i+1 < argc)
+      threads = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--output") == 0 && i+1 < argc)
+      output = argv[++i];
+    else {
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (sweep != NULL)
+    return sweep_run(sweep, &params, threads, output) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+
+  init(&params);
+
+  s = sim_create(&params);
+  if (s == NULL)
+    return EXIT_FAILURE;
+  sim_run(s);
+  sim_report(s);
+  sim_destroy(s);
   return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
+
+#endif /* SIM_NO_MAIN */
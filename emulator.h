@@ -1,11 +1,5 @@
-extern int TRACE;
-
-/* statistics updated by GBN */
-extern int total_ACKs_received;
-extern int packets_resent;       /* count of the number of packets resent  */
-extern int new_ACKs;      /* count of the number of acks correctly received */
-extern int packets_received;  /* count of the packets received by receiver */
-extern int window_full; /* count of the number of messages dropped due to full window */
+#include <stddef.h>
+#include "hist.h"
 
 #define   A    0
 #define   B    1
@@ -27,14 +21,134 @@ struct pkt {
   char payload[20];
 };
 
-/* send to A or B (int), packet to send */
-extern void tolayer3(int, struct pkt);  
+/* one simulation.  All emulator and protocol state hangs off it, and it */
+/* is passed to every entity routine and every student-callable routine. */
+struct sim;
+
+/* how a sender picks its retransmission timeout (see rto.h) */
+#define TIMEOUT_FIXED    0   /* always RTT */
+#define TIMEOUT_ADAPTIVE 1   /* estimated from measured round trips */
+
+/* what to simulate */
+struct sim_params {
+  long long nsimmax;      /* number of msgs to generate, then stop */
+  double lossprob;        /* probability that a packet is dropped  */
+  double corruptprob;     /* probability that one bit is packet is flipped */
+  int corruptdirection;   /* A->B A<-B or bidirectional corruption/loss */
+  double lambda;          /* average time between messages from layer 5 */
+  int trace;              /* how much to print while running */
+  unsigned long long seed; /* seed of the random number streams */
+  const char *tracefile;  /* write a binary event trace here, NULL for none */
+  int timeout;            /* TIMEOUT_FIXED or TIMEOUT_ADAPTIVE */
+  int dupacks;            /* duplicate ACKs that trigger a fast retransmit, 0 for never */
+  int windowsize;         /* sender and receiver window, 0 for the protocol's default */
+  int seqspace;           /* sequence numbers used, 0 for the protocol's default */
+  int sack;               /* SR: ACKs carry a cumulative ack and a bitmap of later packets */
+  int pktimers;           /* SR: a retransmission timer per unacked packet, 0 for one on the oldest */
+  int ackevery;           /* GBN: ACK every this many in-order packets, 0 or 1 for each */
+  double ackdelay;        /* GBN: longest a delayed ACK is held back */
+  int checksum;           /* CKSUM_SUM or CKSUM_CRC32C (checksum.h) */
+  double bandwidth;       /* link rate in packets per time unit, 0 for the original delay model */
+  double propdelay;       /* with a link rate: one-way propagation delay */
+  int queuelimit;         /* with a link rate: packets a link holds, 0 for no limit */
+  int backlog;            /* messages a sender holds while its window is full, 0 to drop them */
+  int bidirectional;      /* 0 = A->B  1 =  A<->B */
+  int flows;              /* sender/receiver pairs sharing the channel, 0 or 1 for one */
+  int msgsize;            /* bytes per application message, 0 for the fixed 20-byte msg */
+  int msgsizemax;         /* with msgsize: sizes are uniform on msgsize..msgsizemax */
+};
+
+struct sim_stats {
+  /* statistics updated by GBN */
+  long long window_full;      /* count of the number of messages dropped due to full window */
+  long long total_ACKs_received;
+  long long packets_resent;   /* count of the number of packets resent  */
+  long long new_ACKs;         /* count of the number of acks correctly received */
+  long long packets_received; /* count of the packets received by receiver */
+  long long spurious_resends; /* intact packets B had already received before */
+  long long fast_retransmits; /* windows resent on duplicate ACKs */
+  long long timeouts_avoided; /* fast retransmits that recovered before the timer went off */
+  long long backlogged;       /* messages that waited in the sender's backlog */
+  int backlog_max;            /* most messages in the backlog at once */
+  struct hist backlog_delay;  /* time messages spent in the backlog */
+  long long piggybacked;      /* ACKs that went on a data packet instead of alone */
+
+  /* statistics updated by emulator */
+  double time;                /* time the simulation ended */
+  long long nsim;             /* number of messages from 5 to 4 so far */
+  long long messages_delivered;
+  long long delivered[2];     /* of those, delivered at A and at B */
+  long long bytes_delivered;  /* with variable-size messages: bytes in whole messages delivered */
+  long long fragments_rejected; /* fragments whose length or offset doesn't fit, dropped */
+  long long ntolayer3;        /* number sent into layer 3 */
+  long long sent[2];          /* of those, sent by A and by B */
+  long long nlost;            /* number lost in media */
+  long long ncorrupt;         /* number corrupted by media*/
+  long long queue_drops[2];   /* dropped at the full link queue of A and of B */
+  double link_busy[2];        /* time the link from A and from B spent transmitting */
+  double queue_area[2];       /* integral over time of the packets held by each link */
+  int queue_max[2];           /* most packets a link held at once */
+  double fairness;            /* Jain's index of the flows' goodput, 1 when all get the same */
+  double flow_goodput_min;    /* least goodput of any flow */
+  double flow_goodput_max;    /* most goodput of any flow */
+  struct hist latency;        /* message generation to delivery at layer 5 */
+  long long events;           /* events dispatched by the main loop */
+  int evpool_chunks;          /* event pool chunks allocated */
+  int evpool_highwater;       /* most events pending at once */
+  long long allocs;           /* heap allocations made by the simulation */
+  long long bytes;            /* heap bytes currently held */
+  long long peak_bytes;       /* most heap bytes held at once */
+};
+
+/* library interface */
+extern void sim_defaults(struct sim_params *);
+extern struct sim *sim_create(const struct sim_params *);
+extern void sim_run(struct sim *);
+extern void sim_report(const struct sim *);
+extern const struct sim_stats *sim_results(const struct sim *);
+extern void sim_destroy(struct sim *);
+
+/* statistics block the protocol code updates */
+extern struct sim_stats *sim_stats(struct sim *);
+
+/* parameters the simulation was created with */
+extern const struct sim_params *sim_config(const struct sim *);
+
+/* current simulated time */
+extern double sim_time(const struct sim *);
+
+/* TRACE level of the simulation */
+extern int sim_trace(const struct sim *);
+
+/* trace output for levels above TRACE_MAX is compiled out.  Benchmark
+   builds use -DTRACE_MAX=0, which leaves no trace tests or format
+   strings in the event loop; the runtime TRACE still selects among the
+   levels that are compiled in. */
+#ifndef TRACE_MAX
+#define TRACE_MAX 4
+#endif
+
+/* true when TRACE > n, the test every trace printf is guarded by */
+#define TRACE_GT(s, n) ((n) < TRACE_MAX && sim_trace(s) > (n))
+
+/* per-simulation storage for the protocol's variables.  The first call
+   allocates size bytes, zeroed, for every flow; later calls return the
+   block of the flow being simulated.  The entry points and the routines
+   below take A or B to mean that end of the flow being simulated. */
+extern void *sim_protocol_state(struct sim *, size_t);
+
+/* send to A or B (int), packet to send.  The packet is copied into the */
+/* emulator's own storage before tolayer3_ptr returns. */
+extern void tolayer3_ptr(struct sim *, int, const struct pkt *);
+
+/* the same, taking the packet by value */
+extern void tolayer3(struct sim *, int, struct pkt);  
 
 /* deliver to A or B (int), data to deliver */
-extern void tolayer5(int, char[20]); 
+extern void tolayer5(struct sim *, int, const char[20]); 
 
 /* start timer at A or B (int), increment */
-extern void starttimer(int, double);       
+extern void starttimer(struct sim *, int, double);       
 
 /* stop timer at A or B (int) */
-extern void stoptimer(int);               
+extern void stoptimer(struct sim *, int);               
@@ -3,6 +3,9 @@
 #include <stdbool.h>
 #include "emulator.h"
 #include "gbn.h"
+#include "rto.h"
+#include "checksum.h"
+#include "backlog.h"
 
 /* ******************************************************************
    Go Back N protocol.  Adapted from J.F.Kurose
@@ -20,10 +23,27 @@
    - removed bidirectional GBN code and other code not used by prac. 
    - fixed C style to adhere to current programming style
    - added GBN implementation
+   - the timeout is RTT, or estimated from round trips with --timeout
+   adaptive (see rto.h)
+   - fast retransmit: with --fast-retransmit N the window is resent as
+   soon as N duplicate ACKs arrive
+   - the window and sequence space can be set at run time; the window
+   buffer is a ring of a power of two slots
+   - delayed ACKs: with --delayed-ack K the receiver ACKs every K in-order
+   packets, or when its timer goes off, and out-of-order ones at once
+   - A_input_ptr and B_input_ptr read the emulator's copy of the packet
+   in place; A_input and B_input remain as by-value wrappers
+   - with --backlog N messages arriving while the window is full wait in
+   a backlog and are sent as ACKs open the window (see backlog.h)
+   - with --bidirectional both entities send data, and ACKs ride on data
+   going the other way when there is any (see entity_input())
+   - A_room and B_room tell the emulator how many messages the entity
+   would send at once, so it can hand over the fragments of a long
+   message as the window opens
 **********************************************************************/
 
 #define RTT  16.0       /* round trip time.  MUST BE SET TO 16.0 when submitting assignment */
-#define WINDOWSIZE 6    /* the maximum number of buffered unacked packet */
+#define WINDOWSIZE 6    /* the maximum number of buffered unacked packet, unless the simulation sets it */
 #define SEQSPACE 7      /* the min sequence space for GBN must be at least windowsize + 1 */
 #define NOTINUSE (-1)   /* used to fill header fields that are not being used */
 
@@ -31,245 +51,592 @@
    the simulator will overwrite part of your packet with 'z's.  It will not overwrite your 
    original checksum.  This procedure must generate a different checksum to the original if
    the packet is corrupted.
+   The simulation picks the checksum engine (see checksum.h); the
+   default is the sum of the header fields and payload bytes.
 */
-int ComputeChecksum(struct pkt packet)
+int ComputeChecksum(struct sim *s, const struct pkt *packet)
 {
-  int checksum = 0;
-  int i;
-
-  checksum = packet.seqnum;
-  checksum += packet.acknum;
-  for ( i=0; i<20; i++ ) 
-    checksum += (int)(packet.payload[i]);
-
-  return checksum;
+  return pkt_checksum(sim_config(s)->checksum, packet);
 }
 
-bool IsCorrupted(struct pkt packet)
+bool IsCorrupted(struct sim *s, const struct pkt *packet)
 {
-  if (packet.checksum == ComputeChecksum(packet))
+  if (packet->checksum == ComputeChecksum(s, packet))
     return (false);
   else
     return (true);
 }
 
 
-/********* Sender (A) variables and functions ************/
+/* one entity's half of the protocol: the sender of the data it
+   originates and the receiver of the data coming the other way.  Without
+   --bidirectional only A's sender and B's receiver are used. */
+struct gbn_entity {
+  /* sender.  The rings follow the structure in the state block. */
+  struct pkt *buffer;             /* ring for storing packets waiting for ACK */
+  int windowfirst, windowlast;    /* ring indexes of the first/last packet awaiting ACK */
+  int windowcount;                /* the number of packets currently awaiting an ACK */
+  int nextseqnum;                 /* the next sequence number to be used by the sender */
+  double *sendtime;               /* when each buffered packet was first sent */
+  bool *resent;                   /* buffered packet has been retransmitted */
+  struct rto rto;                 /* retransmission timeout */
+  int dupacks;                    /* duplicate ACKs in a row for the packet before windowfirst */
+  bool fastresent;                /* window was fast retransmitted, no new ACK since */
+  struct backlog backlog;         /* messages waiting for room in the window */
+
+  /* receiver */
+  int expectedseqnum;             /* the sequence number expected next by the receiver */
+  int ackseqnum;                  /* the sequence number for the next bare ACK */
+  int unacked;                    /* packets delivered since the last ACK */
+
+  /* the emulator gives the entity one timer, for the earlier of these */
+  double rexmitdue;               /* when the window is resent, -1 if nothing is unacked */
+  double ackdue;                  /* when a delayed ACK is sent, -1 if none is held back */
+  double armed;                   /* deadline the emulator timer is set for, -1 if off */
+};
+
+/* all of the protocol's variables, one copy per simulation */
+struct gbn {
+  int windowsize;                 /* the maximum number of buffered unacked packets */
+  int seqspace;                   /* sequence numbers run from 0 to seqspace - 1 */
+  int mask;                       /* slots in the window rings - 1, a power of two - 1 */
+  bool bidirectional;             /* both entities send data */
+  struct gbn_entity e[2];         /* A and B */
+};
+
+static struct gbn *gbn_state(struct sim *s)
+{
+  return sim_protocol_state(s, sizeof(struct gbn));
+}
 
-static struct pkt buffer[WINDOWSIZE];  /* array for storing packets waiting for ACK */
-static int windowfirst, windowlast;    /* array indexes of the first/last packet awaiting ACK */
-static int windowcount;                /* the number of packets currently awaiting an ACK */
-static int A_nextseqnum;               /* the next sequence number to be used by the sender */
+/* allocate the state block with each entity's backlog and window rings
+   after the structure.  A_init() and B_init() both call this; whichever
+   runs first allocates. */
+static struct gbn *gbn_setup(struct sim *s)
+{
+  const struct sim_params *p = sim_config(s);
+  int window = p->windowsize > 0 ? p->windowsize : WINDOWSIZE;
+  int seqspace = p->seqspace > 0 ? p->seqspace : (window == WINDOWSIZE ? SEQSPACE : window + 1);
+  size_t ring, held = backlog_bytes(p->backlog), each;
+  struct gbn_entity *e;
+  struct gbn *g;
+  char *next;
+  int i;
 
-/* called from layer 5 (application layer), passed the message to be sent to other side */
-void A_output(struct msg message)
+  if (seqspace < window + 1) {
+    fprintf(stderr, "gbn: sequence space %d is too small for a window of %d, using %d\n",
+            seqspace, window, window + 1);
+    seqspace = window + 1;
+  }
+  for (ring = 1; ring < (size_t)window; ring <<= 1)
+    ;
+  /* a multiple of 8 bytes, so the next entity's doubles stay aligned */
+  each = (held + ring * (sizeof(double) + sizeof(struct pkt) + sizeof(bool)) + 7) & ~(size_t)7;
+
+  g = sim_protocol_state(s, sizeof(struct gbn) + 2 * each);
+  if (g->windowsize != 0)
+    return g;
+  g->windowsize = window;
+  g->seqspace = seqspace;
+  g->mask = (int)ring - 1;
+  g->bidirectional = p->bidirectional != 0;
+  for (i = A; i <= B; i++) {
+    e = &g->e[i];
+    next = (char *)(g + 1) + i * each;
+    backlog_init(&e->backlog, p->backlog, next);
+    e->sendtime = (double *)(next + held);
+    e->buffer = (struct pkt *)(e->sendtime + ring);
+    e->resent = (bool *)(e->buffer + ring);
+    e->rexmitdue = e->ackdue = e->armed = -1.0;
+  }
+  return g;
+}
+
+#define TIMER_SLACK 1e-9   /* deadlines this close to now have expired */
+
+/* point the emulator's timer at the earlier of the entity's deadlines */
+static void timer_rearm(struct sim *s, struct gbn_entity *e, int AorB)
 {
+  double want = e->rexmitdue;
+
+  if (e->ackdue >= 0 && (want < 0 || e->ackdue < want))
+    want = e->ackdue;
+  if (want == e->armed)
+    return;
+  if (e->armed >= 0)
+    stoptimer(s, AorB);
+  if (want >= 0)
+    starttimer(s, AorB, want - sim_time(s));
+  e->armed = want;
+}
+
+/* (re)start or, with a negative delay, stop the retransmission timer */
+static void rexmit_timer(struct sim *s, struct gbn_entity *e, int AorB, double delay)
+{
+  e->rexmitdue = delay >= 0 ? sim_time(s) + delay : -1.0;
+  timer_rearm(s, e, AorB);
+}
+
+/* the cumulative ACK for the last packet delivered in order */
+static int current_ack(const struct gbn *g, const struct gbn_entity *e)
+{
+  return (e->expectedseqnum + g->seqspace - 1) % g->seqspace;
+}
+
+static void sendack(struct sim *s, struct gbn *g, int AorB);
+
+
+/********* Sender variables and functions ************/
+
+static int piggyback_ack(struct sim *s, struct gbn *g, int AorB);
+
+/* resend every packet awaiting an ACK and restart the timer */
+static void resend_window(struct sim *s, struct gbn *g, int AorB)
+{
+  struct gbn_entity *e = &g->e[AorB];
+  struct pkt *packet;
+  int i, ack;
+
+  for(i=0; i<e->windowcount; i++) {
+    packet = &e->buffer[(e->windowfirst+i) & g->mask];
+
+    if (TRACE_GT(s, 0))
+      printf ("---%c: resending packet %d\n", 'A' + AorB, packet->seqnum);
+
+    /* a resend carries the latest ACK rather than the one it first had */
+    if (g->bidirectional && packet->acknum != (ack = piggyback_ack(s, g, AorB))) {
+      packet->acknum = ack;
+      packet->checksum = ComputeChecksum(s, packet);
+    }
+    tolayer3_ptr(s, AorB, packet);
+    e->resent[(e->windowfirst+i) & g->mask] = true;
+    sim_stats(s)->packets_resent++;
+    if (i==0) rexmit_timer(s, e, AorB, rto_timeout(&e->rto));
+  }
+}
+
+/* the ACK field of a data packet.  Sending it stands in for any ACK the
+   receiver was holding back. */
+static int piggyback_ack(struct sim *s, struct gbn *g, int AorB)
+{
+  struct gbn_entity *e = &g->e[AorB];
+
+  if (!g->bidirectional)
+    return NOTINUSE;
+  if (e->unacked > 0) {
+    sim_stats(s)->piggybacked++;
+    e->unacked = 0;
+    e->ackdue = -1.0;     /* the caller rearms the timer */
+  }
+  return current_ack(g, e);
+}
+
+/* send a message in the next packet of the window, which must have room */
+static void send_message(struct sim *s, struct gbn *g, int AorB, const struct msg *message)
+{
+  struct gbn_entity *e = &g->e[AorB];
   struct pkt sendpkt;
   int i;
 
+  /* create packet */
+  sendpkt.seqnum = e->nextseqnum;
+  sendpkt.acknum = piggyback_ack(s, g, AorB);
+  for ( i=0; i<20 ; i++ ) 
+    sendpkt.payload[i] = message->data[i];
+  sendpkt.checksum = ComputeChecksum(s, &sendpkt); 
+
+  /* put packet in window buffer */
+  /* windowlast will always be 0 for alternating bit; but not for GoBackN */
+  e->windowlast = (e->windowlast + 1) & g->mask; 
+  e->buffer[e->windowlast] = sendpkt;
+  e->sendtime[e->windowlast] = sim_time(s);
+  e->resent[e->windowlast] = false;
+  e->windowcount++;
+
+  /* send out packet */
+  if (TRACE_GT(s, 0))
+    printf("Sending packet %d to layer 3\n", sendpkt.seqnum);
+  tolayer3_ptr(s, AorB, &sendpkt);
+
+  /* start timer if first packet in window */
+  if (e->windowcount == 1)
+    rexmit_timer(s, e, AorB, rto_timeout(&e->rto));
+  else if (g->bidirectional)
+    timer_rearm(s, e, AorB);      /* a held back ACK may have gone with it */
+
+  /* get next sequence number, wrap back to 0 */
+  e->nextseqnum = (e->nextseqnum + 1) % g->seqspace;  
+}
+
+/* send backlogged messages while the window has room */
+static void drain_backlog(struct sim *s, struct gbn *g, int AorB)
+{
+  struct gbn_entity *e = &g->e[AorB];
+  struct msg message;
+
+  while (e->windowcount < g->windowsize && backlog_get(s, &e->backlog, &message)) {
+    if (TRACE_GT(s, 1))
+      printf("----%c: window has room, send backlogged message to layer3!\n", 'A' + AorB);
+    send_message(s, g, AorB, &message);
+  }
+}
+
+/* called from layer 5 (application layer), passed the message to be sent to other side */
+static void entity_output(struct sim *s, int AorB, const struct msg *message)
+{
+  struct gbn *g = gbn_state(s);
+  struct gbn_entity *e = &g->e[AorB];
+
   /* if not blocked waiting on ACK */
-  if ( windowcount < WINDOWSIZE) {
-    if (TRACE > 1)
-      printf("----A: New message arrives, send window is not full, send new messge to layer3!\n");
-
-    /* create packet */
-    sendpkt.seqnum = A_nextseqnum;
-    sendpkt.acknum = NOTINUSE;
-    for ( i=0; i<20 ; i++ ) 
-      sendpkt.payload[i] = message.data[i];
-    sendpkt.checksum = ComputeChecksum(sendpkt); 
-
-    /* put packet in window buffer */
-    /* windowlast will always be 0 for alternating bit; but not for GoBackN */
-    windowlast = (windowlast + 1) % WINDOWSIZE; 
-    buffer[windowlast] = sendpkt;
-    windowcount++;
-
-    /* send out packet */
-    if (TRACE > 0)
-      printf("Sending packet %d to layer 3\n", sendpkt.seqnum);
-    tolayer3 (A, sendpkt);
-
-    /* start timer if first packet in window */
-    if (windowcount == 1)
-      starttimer(A,RTT);
-
-    /* get next sequence number, wrap back to 0 */
-    A_nextseqnum = (A_nextseqnum + 1) % SEQSPACE;  
+  if ( e->windowcount < g->windowsize) {
+    if (TRACE_GT(s, 1))
+      printf("----%c: New message arrives, send window is not full, send new messge to layer3!\n", 'A' + AorB);
+    send_message(s, g, AorB, message);
+  }
+  /* if blocked, window is full: wait in the backlog if it has room */
+  else if (backlog_put(s, &e->backlog, message)) {
+    if (TRACE_GT(s, 0))
+      printf("----%c: New message arrives, send window is full, message backlogged\n", 'A' + AorB);
   }
-  /* if blocked,  window is full */
   else {
-    if (TRACE > 0)
-      printf("----A: New message arrives, send window is full\n");
-    window_full++;
+    if (TRACE_GT(s, 0))
+      printf("----%c: New message arrives, send window is full\n", 'A' + AorB);
+    sim_stats(s)->window_full++;
   }
 }
 
+void A_output(struct sim *s, struct msg message)
+{
+  entity_output(s, A, &message);
+}
 
-/* called from layer 3, when a packet arrives for layer 4 
-   In this practical this will always be an ACK as B never sends data.
-*/
-void A_input(struct pkt packet)
+/* messages the entity would send at once: the room left in the window,
+   none while messages are waiting in the backlog */
+static int entity_room(struct sim *s, int AorB)
+{
+  struct gbn *g = gbn_state(s);
+  struct gbn_entity *e = &g->e[AorB];
+
+  return e->backlog.count > 0 ? 0 : g->windowsize - e->windowcount;
+}
+
+int A_room(struct sim *s)
 {
+  return entity_room(s, A);
+}
+
+/* an intact packet carrying an ACK has arrived.  Only a bare ACK counts
+   towards a fast retransmit: data packets repeat the receiver's ACK
+   whenever there is nothing new to acknowledge. */
+static void ack_input(struct sim *s, struct gbn *g, int AorB, const struct pkt *packet, bool bare)
+{
+  struct gbn_entity *e = &g->e[AorB];
   int ackcount = 0;
-  int i;
+  int acked;
 
-  /* if received ACK is not corrupted */ 
-  if (!IsCorrupted(packet)) {
-    if (TRACE > 0)
-      printf("----A: uncorrupted ACK %d is received\n",packet.acknum);
-    total_ACKs_received++;
+    if (TRACE_GT(s, 0))
+      printf("----%c: uncorrupted ACK %d is received\n", 'A' + AorB, packet->acknum);
+    sim_stats(s)->total_ACKs_received++;
 
     /* check if new ACK or duplicate */
-    if (windowcount != 0) {
-          int seqfirst = buffer[windowfirst].seqnum;
-          int seqlast = buffer[windowlast].seqnum;
+    if (e->windowcount != 0) {
+          int seqfirst = e->buffer[e->windowfirst].seqnum;
+          int seqlast = e->buffer[e->windowlast].seqnum;
           /* check case when seqnum has and hasn't wrapped */
-          if (((seqfirst <= seqlast) && (packet.acknum >= seqfirst && packet.acknum <= seqlast)) ||
-              ((seqfirst > seqlast) && (packet.acknum >= seqfirst || packet.acknum <= seqlast))) {
+          if (((seqfirst <= seqlast) && (packet->acknum >= seqfirst && packet->acknum <= seqlast)) ||
+              ((seqfirst > seqlast) && (packet->acknum >= seqfirst || packet->acknum <= seqlast))) {
 
             /* packet is a new ACK */
-            if (TRACE > 0)
-              printf("----A: ACK %d is not a duplicate\n",packet.acknum);
-            new_ACKs++;
+            if (TRACE_GT(s, 0))
+              printf("----%c: ACK %d is not a duplicate\n", 'A' + AorB, packet->acknum);
+            sim_stats(s)->new_ACKs++;
+            e->dupacks = 0;
+            if (e->fastresent) {
+              sim_stats(s)->timeouts_avoided++;
+              e->fastresent = false;
+            }
 
             /* cumulative acknowledgement - determine how many packets are ACKed */
-            if (packet.acknum >= seqfirst)
-              ackcount = packet.acknum + 1 - seqfirst;
+            if (packet->acknum >= seqfirst)
+              ackcount = packet->acknum + 1 - seqfirst;
             else
-              ackcount = SEQSPACE - seqfirst + packet.acknum;
+              ackcount = g->seqspace - seqfirst + packet->acknum;
+
+            /* time the round trip of the packet ACKed, unless it was resent (Karn) */
+            acked = (e->windowfirst + ackcount - 1) & g->mask;
+            if (!e->resent[acked])
+              rto_sample(&e->rto, sim_time(s) - e->sendtime[acked]);
 
 	    /* slide window by the number of packets ACKed */
-            windowfirst = (windowfirst + ackcount) % WINDOWSIZE;
+            e->windowfirst = (e->windowfirst + ackcount) & g->mask;
 
             /* delete the acked packets from window buffer */
-            for (i=0; i<ackcount; i++)
-              windowcount--;
+            e->windowcount -= ackcount;
 
 	    /* start timer again if there are still more unacked packets in window */
-            stoptimer(A);
-            if (windowcount > 0)
-              starttimer(A, RTT);
+            rexmit_timer(s, e, AorB, e->windowcount > 0 ? rto_timeout(&e->rto) : -1.0);
 
+            /* the window has room again for backlogged messages */
+            drain_backlog(s, g, AorB);
+          }
+          else if (bare && packet->acknum == (seqfirst + g->seqspace - 1) % g->seqspace) {
+            /* the receiver is still waiting for seqfirst: after enough of
+               these resend the window rather than wait for the timer */
+            e->dupacks++;
+            if (TRACE_GT(s, 0))
+              printf("----%c: duplicate ACK %d received (%d in a row)\n", 'A' + AorB, packet->acknum, e->dupacks);
+            if (e->dupacks == sim_config(s)->dupacks && !e->fastresent) {
+              if (TRACE_GT(s, 0))
+                printf("----%c: fast retransmit, resend packets!\n", 'A' + AorB);
+              rexmit_timer(s, e, AorB, -1.0);
+              resend_window(s, g, AorB);
+              e->fastresent = true;
+              sim_stats(s)->fast_retransmits++;
+            }
           }
         }
         else
-          if (TRACE > 0)
-        printf ("----A: duplicate ACK received, do nothing!\n");
-  }
-  else 
-    if (TRACE > 0)
-      printf ("----A: corrupted ACK is received, do nothing!\n");
+          if (TRACE_GT(s, 0))
+        printf ("----%c: duplicate ACK received, do nothing!\n", 'A' + AorB);
 }
 
-/* called when A's timer goes off */
-void A_timerinterrupt(void)
+/* called when the entity's timer goes off: the window is due to be
+   resent, a delayed ACK is due, or both */
+static void entity_timerinterrupt(struct sim *s, int AorB)
 {
-  int i;
-
-  if (TRACE > 0)
-    printf("----A: time out,resend packets!\n");
-
-  for(i=0; i<windowcount; i++) {
-
-    if (TRACE > 0)
-      printf ("---A: resending packet %d\n", (buffer[(windowfirst+i) % WINDOWSIZE]).seqnum);
-
-    tolayer3(A,buffer[(windowfirst+i) % WINDOWSIZE]);
-    packets_resent++;
-    if (i==0) starttimer(A,RTT);
+  struct gbn *g = gbn_state(s);
+  struct gbn_entity *e = &g->e[AorB];
+  double due = sim_time(s);
+
+  /* the deadline the timer was set for has passed, and any other one
+     that is no later */
+  if (e->armed > due)
+    due = e->armed;
+  due += TIMER_SLACK;
+  e->armed = -1.0;       /* the emulator timer has just gone off */
+
+  /* a resend carries the ACK, so it goes first */
+  if (e->rexmitdue >= 0 && e->rexmitdue <= due) {
+    if (TRACE_GT(s, 0))
+      printf("----%c: time out,resend packets!\n", 'A' + AorB);
+    rto_timedout(&e->rto);
+    e->dupacks = 0;
+    e->fastresent = false;
+    e->rexmitdue = -1.0;
+
+    resend_window(s, g, AorB);
   }
-}       
 
+  if (e->ackdue >= 0 && e->ackdue <= due) {
+    e->ackdue = -1.0;
+    if (e->unacked > 0)
+      sendack(s, g, AorB);
+  }
+  timer_rearm(s, e, AorB);
+}
 
+void A_timerinterrupt(struct sim *s)
+{
+  entity_timerinterrupt(s, A);
+}       
 
-/* the following routine will be called once (only) before any other */
-/* entity A routines are called. You can use it to do any initialization */
-void A_init(void)
+/* set up an entity.  Without --bidirectional B only receives. */
+static void entity_init(struct sim *s, int AorB)
 {
-  /* initialise A's window, buffer and sequence number */
-  A_nextseqnum = 0;  /* A starts with seq num 0, do not change this */
-  windowfirst = 0;
-  windowlast = -1;   /* windowlast is where the last packet sent is stored.  
+  struct gbn *g = gbn_setup(s);
+  struct gbn_entity *e = &g->e[AorB];
+
+  /* initialise the window, buffer and sequence number */
+  e->nextseqnum = 0;  /* A starts with seq num 0, do not change this */
+  e->windowfirst = 0;
+  e->windowlast = -1;   /* windowlast is where the last packet sent is stored.  
 		     new packets are placed in winlast + 1 
 		     so initially this is set to -1
 		   */
-  windowcount = 0;
-}
+  e->windowcount = 0;
+  rto_init(&e->rto, sim_config(s)->timeout, RTT);
 
+  /* and the receiver */
+  e->expectedseqnum = 0;
+  e->ackseqnum = 1;
+}
 
+/* the following routine will be called once (only) before any other */
+/* entity A routines are called. You can use it to do any initialization */
+void A_init(struct sim *s)
+{
+  entity_init(s, A);
+}
 
-/********* Receiver (B)  variables and procedures ************/
 
-static int expectedseqnum; /* the sequence number expected next by the receiver */
-static int B_nextseqnum;   /* the sequence number for the next packets sent by B */
 
+/********* Receiver variables and procedures ************/
 
-/* called from layer 3, when a packet arrives for layer 4 at B*/
-void B_input(struct pkt packet)
+/* send a cumulative ACK for the last packet delivered in order.  Any
+   ACK held back by delayed ACKs goes with it. */
+static void sendack(struct sim *s, struct gbn *g, int AorB)
 {
+  struct gbn_entity *e = &g->e[AorB];
   struct pkt sendpkt;
   int i;
 
+  if (e->ackdue >= 0) {
+    e->ackdue = -1.0;
+    timer_rearm(s, e, AorB);
+  }
+  e->unacked = 0;
+
+  /* create packet.  With data going both ways a bare ACK is told
+     apart from data by its unused seqnum. */
+  sendpkt.acknum = current_ack(g, e);
+  if (g->bidirectional)
+    sendpkt.seqnum = NOTINUSE;
+  else {
+    sendpkt.seqnum = e->ackseqnum;
+    e->ackseqnum = (e->ackseqnum + 1) % 2;
+  }
+    
+  /* we don't have any data to send.  fill payload with 0's */
+  for ( i=0; i<20 ; i++ ) 
+    sendpkt.payload[i] = '0';  
+
+  /* computer checksum */
+  sendpkt.checksum = ComputeChecksum(s, &sendpkt); 
+
+  /* send out packet */
+  tolayer3_ptr(s, AorB, &sendpkt);
+}
+
+/* a data packet has arrived at the receiver of AorB */
+static void data_input(struct sim *s, struct gbn *g, int AorB, const struct pkt *packet, bool corrupt)
+{
+  struct gbn_entity *e = &g->e[AorB];
+  const struct sim_params *p = sim_config(s);
+  int behind, every;
+
+  /* a packet up to seqspace - windowsize behind the expected one must be
+     a copy of one already delivered: the sender can't be that far
+     ahead.  Further back it could also be a packet from beyond a gap,
+     so with the default 7 and 6 this only catches resends of the last
+     one; with seqspace >= 2 * windowsize it catches them all. */
+  behind = (e->expectedseqnum - packet->seqnum + g->seqspace) % g->seqspace;
+  if (!corrupt && behind >= 1 && behind <= g->seqspace - g->windowsize)
+    sim_stats(s)->spurious_resends++;
+
   /* if not corrupted and received packet is in order */
-  if  ( (!IsCorrupted(packet))  && (packet.seqnum == expectedseqnum) ) {
-    if (TRACE > 0)
-      printf("----B: packet %d is correctly received, send ACK!\n",packet.seqnum);
-    packets_received++;
+  if  ( (!corrupt)  && (packet->seqnum == e->expectedseqnum) ) {
+    if (TRACE_GT(s, 0))
+      printf("----%c: packet %d is correctly received, send ACK!\n", 'A' + AorB, packet->seqnum);
+    sim_stats(s)->packets_received++;
 
     /* deliver to receiving application */
-    tolayer5(B, packet.payload);
-
-    /* send an ACK for the received packet */
-    sendpkt.acknum = expectedseqnum;
+    tolayer5(s, AorB, packet->payload);
 
     /* update state variables */
-    expectedseqnum = (expectedseqnum + 1) % SEQSPACE;        
+    e->expectedseqnum = (e->expectedseqnum + 1) % g->seqspace;        
+
+    /* delayed ACKs: hold the ACK back until ackevery packets have
+       arrived in order, or ackdelay has passed since the first of them.
+       With data going both ways every other packet is ACKed at the
+       latest, so that the ACK has a chance to ride on data. */
+    every = p->ackevery > 1 ? p->ackevery : (g->bidirectional ? 2 : 1);
+    if (++e->unacked < every) {
+      if (e->ackdue < 0) {
+        e->ackdue = sim_time(s) + p->ackdelay;
+        timer_rearm(s, e, AorB);
+      }
+      return;
+    }
   }
   else {
     /* packet is corrupted or out of order resend last ACK */
-    if (TRACE > 0) 
-      printf("----B: packet corrupted or not expected sequence number, resend ACK!\n");
-    if (expectedseqnum == 0)
-      sendpkt.acknum = SEQSPACE - 1;
-    else
-      sendpkt.acknum = expectedseqnum - 1;
+    if (TRACE_GT(s, 0)) 
+      printf("----%c: packet corrupted or not expected sequence number, resend ACK!\n", 'A' + AorB);
   }
 
-  /* create packet */
-  sendpkt.seqnum = B_nextseqnum;
-  B_nextseqnum = (B_nextseqnum + 1) % 2;
-    
-  /* we don't have any data to send.  fill payload with 0's */
-  for ( i=0; i<20 ; i++ ) 
-    sendpkt.payload[i] = '0';  
+  /* send an ACK for the received packet */
+  sendack(s, g, AorB);
+}
 
-  /* computer checksum */
-  sendpkt.checksum = ComputeChecksum(sendpkt); 
+/* called from layer 3, when a packet arrives for layer 4.  With data in
+   one direction A only gets ACKs and B only data.  With data going both
+   ways a packet can be either or both: an intact one is passed to the
+   sender if its acknum is in use and to the receiver if its seqnum is.
+   A corrupted one is dropped, because it may have been a bare ACK and
+   answering it would have ACKs answering ACKs; the sender's timer
+   recovers it. */
+static void entity_input(struct sim *s, int AorB, const struct pkt *packet)
+{
+  struct gbn *g = gbn_state(s);
+  bool corrupt = IsCorrupted(s, packet);
+
+  if (g->bidirectional) {
+    if (corrupt) {
+      if (TRACE_GT(s, 0))
+        printf("----%c: corrupted packet is received, drop it!\n", 'A' + AorB);
+      return;
+    }
+    if (packet->acknum != NOTINUSE)
+      ack_input(s, g, AorB, packet, packet->seqnum == NOTINUSE);
+    if (packet->seqnum != NOTINUSE)
+      data_input(s, g, AorB, packet, false);
+  }
+  else if (AorB == B)
+    data_input(s, g, B, packet, corrupt);
+  else if (!corrupt)
+    ack_input(s, g, A, packet, true);
+  else 
+    if (TRACE_GT(s, 0))
+      printf ("----A: corrupted ACK is received, do nothing!\n");
+}
 
-  /* send out packet */
-  tolayer3 (B, sendpkt);
+void A_input_ptr(struct sim *s, const struct pkt *packet)
+{
+  entity_input(s, A, packet);
+}
+
+/* called from layer 3, when a packet arrives for layer 4 at B*/
+void B_input_ptr(struct sim *s, const struct pkt *packet)
+{
+  entity_input(s, B, packet);
+}
+
+/* by-value entry points, for callers written against the original API */
+void A_input(struct sim *s, struct pkt packet)
+{
+  A_input_ptr(s, &packet);
+}
+
+void B_input(struct sim *s, struct pkt packet)
+{
+  B_input_ptr(s, &packet);
 }
 
 /* the following routine will be called once (only) before any other */
 /* entity B routines are called. You can use it to do any initialization */
-void B_init(void)
+void B_init(struct sim *s)
 {
-  expectedseqnum = 0;
-  B_nextseqnum = 1;
+  entity_init(s, B);
 }
 
 /******************************************************************************
- * The following functions need be completed only for bi-directional messages *
+ * The following functions are used only for bi-directional messages         *
  *****************************************************************************/
 
-/* Note that with simplex transfer from a-to-B, there is no B_output() */
-void B_output(struct msg message)  
+/* with --bidirectional B sends data too; otherwise it is never called */
+void B_output(struct sim *s, struct msg message)  
 {
+  entity_output(s, B, &message);
 }
 
-/* called when B's timer goes off */
-void B_timerinterrupt(void)
+int B_room(struct sim *s)
 {
+  return entity_room(s, B);
 }
 
+/* called when B's timer goes off: a delayed ACK is due, or with data
+   going both ways a retransmission */
+void B_timerinterrupt(struct sim *s)
+{
+  entity_timerinterrupt(s, B);
+}
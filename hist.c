@@ -0,0 +1,84 @@
+#include <string.h>
+#include <stdint.h>
+#include "hist.h"
+
+/* bucket holding a value of t ticks */
+static int bucketof(uint64_t t)
+{
+  int msb;
+
+  if (t < HIST_SUBBUCKETS)
+    return (int)t;
+  msb = 63 - __builtin_clzll(t);
+  return (msb - HIST_SUBBITS + 1) * HIST_SUBBUCKETS
+    + (int)(t >> (msb - HIST_SUBBITS)) - HIST_SUBBUCKETS;
+}
+
+/* smallest tick count that lands in bucket i */
+static uint64_t bucketlow(int i)
+{
+  int shift;
+
+  if (i < HIST_SUBBUCKETS)
+    return (uint64_t)i;
+  shift = i / HIST_SUBBUCKETS - 1;
+  return (uint64_t)(i % HIST_SUBBUCKETS + HIST_SUBBUCKETS) << shift;
+}
+
+void hist_init(struct hist *h)
+{
+  memset(h, 0, sizeof(*h));
+}
+
+void hist_record(struct hist *h, double value)
+{
+  double ticks = value / HIST_RESOLUTION;
+  uint64_t t;
+
+  if (ticks < 0)
+    ticks = 0;
+  t = ticks >= 0x1p63 ? UINT64_MAX >> 1 : (uint64_t)ticks;
+  h->buckets[bucketof(t)]++;
+  h->count++;
+  h->sum += value;
+  if (value > h->max)
+    h->max = value;
+}
+
+void hist_merge(struct hist *into, const struct hist *from)
+{
+  int i;
+
+  for (i = 0; i < HIST_BUCKETS; i++)
+    into->buckets[i] += from->buckets[i];
+  into->count += from->count;
+  into->sum += from->sum;
+  if (from->max > into->max)
+    into->max = from->max;
+}
+
+/* reports the middle of the bucket the quantile falls in, never more than
+   the largest value recorded */
+double hist_quantile(const struct hist *h, double q)
+{
+  long long rank, seen = 0;
+  double v;
+  int i;
+
+  if (h->count == 0)
+    return 0.0;
+  rank = (long long)(q * h->count + 0.5);
+  if (rank < 1)
+    rank = 1;
+  if (rank > h->count)
+    rank = h->count;
+  for (i = 0; i < HIST_BUCKETS; i++) {
+    seen += h->buckets[i];
+    if (seen >= rank)
+      break;
+  }
+  if (i == HIST_BUCKETS - 1)
+    return h->max;
+  v = (bucketlow(i) + bucketlow(i + 1)) / 2.0 * HIST_RESOLUTION;
+  return v < h->max ? v : h->max;
+}
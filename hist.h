@@ -0,0 +1,23 @@
+/* log-bucketed histogram of non-negative values (HDR style).  Values are
+   counted in ticks of HIST_RESOLUTION; each power of two of ticks is split
+   into 2^HIST_SUBBITS buckets, so a bucket is never wider than about 3% of
+   the values in it.  Fixed size: recording never allocates. */
+
+#define HIST_SUBBITS    5
+#define HIST_SUBBUCKETS (1 << HIST_SUBBITS)
+#define HIST_BUCKETS    ((64 - HIST_SUBBITS + 1) * HIST_SUBBUCKETS)
+#define HIST_RESOLUTION (1.0/1024)   /* smallest distinguishable value */
+
+struct hist {
+  long long count;                   /* number of values recorded */
+  double sum;                        /* for the mean */
+  double max;                        /* exact largest value */
+  long long buckets[HIST_BUCKETS];
+};
+
+extern void hist_init(struct hist *);
+extern void hist_record(struct hist *, double value);
+extern void hist_merge(struct hist *into, const struct hist *from);
+
+/* value below which fraction q (0..1) of the recorded values fall */
+extern double hist_quantile(const struct hist *, double q);
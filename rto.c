@@ -0,0 +1,47 @@
+#include <math.h>
+#include "emulator.h"
+#include "rto.h"
+
+#define RTO_MIN      2.0   /* the fastest possible round trip: one time unit each way */
+#define RTO_MAX   1000.0
+#define RTO_MAXBACKOFF 6   /* doublings, at most 64 times the estimate */
+
+void rto_init(struct rto *r, int policy, double initial)
+{
+  r->adaptive = policy == TIMEOUT_ADAPTIVE;
+  r->initial = initial;
+  r->srtt = 0.0;
+  r->rttvar = 0.0;
+  r->base = initial;
+  r->backoff = 0;
+  r->samples = 0;
+}
+
+void rto_sample(struct rto *r, double rtt)
+{
+  if (!r->adaptive)
+    return;
+  if (r->samples++ == 0) {
+    r->srtt = rtt;
+    r->rttvar = rtt / 2;
+  }
+  else {
+    r->rttvar = 0.75 * r->rttvar + 0.25 * fabs(r->srtt - rtt);
+    r->srtt = 0.875 * r->srtt + 0.125 * rtt;
+  }
+  r->base = fmin(fmax(r->srtt + 4 * r->rttvar, RTO_MIN), RTO_MAX);
+  r->backoff = 0;
+}
+
+void rto_timedout(struct rto *r)
+{
+  if (r->adaptive && r->backoff < RTO_MAXBACKOFF)
+    r->backoff++;
+}
+
+double rto_timeout(const struct rto *r)
+{
+  if (!r->adaptive)
+    return r->initial;
+  return fmin(ldexp(r->base, r->backoff), RTO_MAX);
+}
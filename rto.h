@@ -0,0 +1,32 @@
+/* retransmission timeout of a sender.  With TIMEOUT_FIXED the timeout is
+   always the initial value.  With TIMEOUT_ADAPTIVE it is estimated from
+   round trip samples as in Jacobson/Karels (RFC 6298):
+
+     srtt   <- 7/8 srtt + 1/8 r
+     rttvar <- 3/4 rttvar + 1/4 |srtt - r|
+     rto    =  srtt + 4 rttvar
+
+   and doubled on every timeout until the next sample.  Following Karn's
+   rule the caller only samples packets that were never retransmitted,
+   so an ACK can't be matched with the wrong transmission. */
+
+struct rto {
+  int adaptive;       /* TIMEOUT_ADAPTIVE */
+  double initial;     /* timeout before the first sample */
+  double srtt;        /* smoothed round trip time */
+  double rttvar;      /* smoothed mean deviation of the round trip time */
+  double base;        /* timeout computed from the samples so far */
+  int backoff;        /* timeouts since the last sample */
+  long long samples;  /* round trip samples taken */
+};
+
+extern void rto_init(struct rto *, int policy, double initial);
+
+/* a packet sent once was acknowledged rtt time units after it was sent */
+extern void rto_sample(struct rto *, double rtt);
+
+/* the timer went off: back off */
+extern void rto_timedout(struct rto *);
+
+/* time to wait for an ACK before retransmitting */
+extern double rto_timeout(const struct rto *);
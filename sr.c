@@ -2,220 +2,724 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <string.h>
+#include <stdint.h>
 #include "emulator.h"
 #include "sr.h"
+#include "rto.h"
+#include "checksum.h"
+#include "backlog.h"
 
 #define RTT 16.0
-#define WINDOWSIZE 6
-#define SEQSPACE 20
+#define WINDOWSIZE 6    /* window when the simulation does not set one */
+#define SEQSPACE 20     /* least sequence space when the simulation does not set one */
 #define NOTINUSE (-1)
+#define TIMER_SLACK 1e-9   /* deadlines this close to now have expired */
+#define SACKBYTES 16       /* payload bytes of a SACK bitmap, 128 packets */
+
+/* the window and sequence space are simulation parameters.  Packets are
+   numbered with absolute sequence numbers internally; the seqnum on the
+   wire is the absolute number modulo seqspace.  Per-packet state lives in
+   rings of a power of two slots, at least a window's worth, indexed by
+   the absolute number masked with ring - 1.  Acked and received packets
+   are tracked in bitmaps, so the sender's window slides over a run of
+   acked packets a word at a time.
+
+   Each entity has a sender, for the data it originates, and a receiver,
+   for the data coming the other way.  Without --bidirectional only A's
+   sender and B's receiver are used.  A bare ACK has seqnum NOTINUSE and
+   a data packet that carries no ACK has acknum NOTINUSE, so with data
+   going both ways a packet can carry both. */
+struct sr_entity {
+  /* sender */
+  long long send_base;           /* oldest unacked packet */
+  long long nextseqnum;          /* next packet to send */
+  struct pkt *send_buffer;       /* packets awaiting an ACK, by slot */
+  uint64_t *acked;               /* packet in the slot has been ACKed */
+  uint64_t *resent;              /* packet in the slot has been retransmitted */
+  double *sendtime;              /* when the packet in each slot was first sent */
+
+  /* with --per-packet-timers every unacked packet has its own
+     retransmission deadline; otherwise, as in the original SR, only the
+     oldest has one, started when it becomes the oldest, so the packets
+     of a burst queued in the channel can't all time out together.  The
+     pending deadlines are kept in a min-heap of buffer slots ordered on
+     deadline, and the emulator's single timer for the entity is always
+     set for the earliest of them, or for a delayed ACK if that is due
+     first. */
+  double *deadline;              /* when the packet in each slot times out */
+  int *timerheap;                /* slots with a pending deadline */
+  int *timerpos;                 /* index of each slot in the heap, -1 if none */
+  int ntimers;
+  double armed;                  /* deadline the emulator timer is set for, -1 if off */
+  struct rto rto;                /* retransmission timeout */
+  struct backlog backlog;        /* messages waiting for room in the window */
+
+  /* receiver */
+  long long expectedseqnum;      /* oldest packet not yet delivered */
+  uint64_t *received;            /* packet in the slot is buffered */
+  char (*payload)[20];           /* buffered payloads, by slot */
+
+  /* with data going both ways an ACK is held back for a while in the
+     hope that it can go on a data packet */
+  int ackheld;                   /* seqnum of the ACK held back, -1 if none */
+  int unacked;                   /* SACK: packets delivered since the last ACK */
+  double ackdue;                 /* when the held back ACK goes alone, -1 if none */
+};
+
+struct sr {
+  int windowsize;
+  int seqspace;
+  int mask;                      /* ring slots - 1 */
+  bool sack;                     /* ACKs are cumulative with a SACK bitmap */
+  bool bidirectional;            /* both entities send data */
+  bool pktimers;                 /* a retransmission deadline per unacked packet */
+  struct sr_entity e[2];         /* A and B */
+};
+
+static struct sr *sr_state(struct sim *s)
+{
+  return sim_protocol_state(s, sizeof(struct sr));
+}
 
-static struct pkt A_send_buffer[SEQSPACE];
-static bool A_acked_status[SEQSPACE];
-static int send_base;
-static int A_nextseqnum;
+/* allocate the state block with room for both entities' rings after the
+   structure, and point the rings into it.  A_init() and B_init() both
+   call this; whichever runs first allocates. */
+static struct sr *sr_setup(struct sim *s)
+{
+  const struct sim_params *p = sim_config(s);
+  int window = p->windowsize > 0 ? p->windowsize : WINDOWSIZE;
+  int seqspace = p->seqspace > 0 ? p->seqspace : (2*window > SEQSPACE ? 2*window : SEQSPACE);
+  size_t ring, words, held = backlog_bytes(p->backlog), each;
+  struct sr_entity *e;
+  struct sr *r;
+  char *next;
+  int i;
 
-static int expectedseqnum;
-static struct pkt B_recv_buffer[SEQSPACE];
+  /* with less than two windows of sequence numbers the receiver can't
+     tell a resend of an old packet from a new one */
+  if (seqspace < 2*window) {
+    fprintf(stderr, "sr: sequence space %d is too small for a window of %d, using %d\n",
+            seqspace, window, 2*window);
+    seqspace = 2*window;
+  }
+  for (ring = 1; ring < (size_t)window; ring <<= 1)
+    ;
+  words = (ring + 63) / 64;
+
+  /* the rings in order of decreasing alignment, each entity's rounded up
+     to keep the next one's aligned */
+  each = (held + ring * (2*sizeof(double) + sizeof(struct pkt) + 2*sizeof(int) + 20)
+          + words * 3*sizeof(uint64_t) + 7) & ~(size_t)7;
+  r = sim_protocol_state(s, sizeof(struct sr) + 2 * each);
+  if (r->windowsize != 0)
+    return r;
+  r->windowsize = window;
+  r->seqspace = seqspace;
+  r->sack = p->sack != 0;
+  r->bidirectional = p->bidirectional != 0;
+  r->pktimers = p->pktimers != 0;
+  r->mask = (int)ring - 1;
+  for (i = A; i <= B; i++) {
+    e = &r->e[i];
+    next = (char *)(r + 1) + i * each;
+    backlog_init(&e->backlog, p->backlog, next); next += held;
+    e->sendtime = (double *)next;        next += ring * sizeof(double);
+    e->deadline = (double *)next;        next += ring * sizeof(double);
+    e->acked = (uint64_t *)next;         next += words * sizeof(uint64_t);
+    e->resent = (uint64_t *)next;        next += words * sizeof(uint64_t);
+    e->received = (uint64_t *)next;      next += words * sizeof(uint64_t);
+    e->send_buffer = (struct pkt *)next; next += ring * sizeof(struct pkt);
+    e->timerheap = (int *)next;          next += ring * sizeof(int);
+    e->timerpos = (int *)next;           next += ring * sizeof(int);
+    e->payload = (char (*)[20])next;
+  }
+  return r;
+}
 
-int ComputeChecksum(struct pkt packet)
+/* the checksum engine is chosen by the simulation, see checksum.h */
+int ComputeChecksum(struct sim *s, const struct pkt *packet)
 {
-  int checksum = 0;
-  int i;
-  checksum = packet.seqnum;
-  checksum += packet.acknum;
-  for (i = 0; i < 20; i++) checksum += (int)(packet.payload[i]);
-  return checksum;
+  return pkt_checksum(sim_config(s)->checksum, packet);
 }
 
-bool IsCorrupted(struct pkt packet)
+bool IsCorrupted(struct sim *s, const struct pkt *packet)
 {
-  if (packet.checksum == ComputeChecksum(packet)) return (false);
+  if (packet->checksum == ComputeChecksum(s, packet)) return (false);
   else return (true);
 }
 
-bool is_seq_in_window(int seq_num, int win_base, int win_size, int seq_space) {
-    int win_end = (win_base + win_size) % seq_space;
-    if (win_base < win_end) {
-        return (seq_num >= win_base && seq_num < win_end);
-    } else {
-        return (seq_num >= win_base || seq_num < win_end);
+/********* bitmaps over the rings ************/
+
+static bool bit_test(const uint64_t *map, int slot)
+{
+  return (map[slot >> 6] >> (slot & 63)) & 1;
+}
+
+static void bit_set(uint64_t *map, int slot)
+{
+  map[slot >> 6] |= (uint64_t)1 << (slot & 63);
+}
+
+static void bit_clear(uint64_t *map, int slot)
+{
+  map[slot >> 6] &= ~((uint64_t)1 << (slot & 63));
+}
+
+/* how many of the limit packets from absolute number from on have their
+   bit set, counting up to the first that hasn't.  Works a word at a time. */
+static long long bit_run(const struct sr *r, const uint64_t *map, long long from, long long limit)
+{
+  long long run = 0;
+  int slot, bit, span;
+  uint64_t holes;
+
+  while (run < limit) {
+    slot = (int)((from + run) & r->mask);
+    bit = slot & 63;
+    span = 64 - bit;                          /* bits left in this word */
+    if (span > r->mask + 1 - slot)
+      span = r->mask + 1 - slot;              /* or before the ring wraps */
+    holes = ~map[slot >> 6] >> bit;
+    if (span < 64)
+      holes &= ((uint64_t)1 << span) - 1;
+    if (holes != 0) {
+      run += __builtin_ctzll(holes);
+      break;
     }
+    run += span;
+  }
+  return run < limit ? run : limit;
+}
+
+/********* per-packet retransmission timers ************/
+
+static void timer_place(struct sr_entity *e, int slot, int pos)
+{
+  e->timerheap[pos] = slot;
+  e->timerpos[slot] = pos;
+}
+
+static void timer_siftup(struct sr_entity *e, int pos)
+{
+  int slot = e->timerheap[pos];
+  int parent;
+
+  while (pos > 0) {
+    parent = (pos - 1) / 2;
+    if (e->deadline[e->timerheap[parent]] <= e->deadline[slot])
+      break;
+    timer_place(e, e->timerheap[parent], pos);
+    pos = parent;
+  }
+  timer_place(e, slot, pos);
+}
+
+static void timer_siftdown(struct sr_entity *e, int pos)
+{
+  int slot = e->timerheap[pos];
+  int child;
+
+  while ((child = 2*pos + 1) < e->ntimers) {
+    if (child+1 < e->ntimers && e->deadline[e->timerheap[child+1]] < e->deadline[e->timerheap[child]])
+      child++;
+    if (e->deadline[slot] <= e->deadline[e->timerheap[child]])
+      break;
+    timer_place(e, e->timerheap[child], pos);
+    pos = child;
+  }
+  timer_place(e, slot, pos);
+}
+
+/* forget the deadline of a slot, if it has one */
+static void timer_cancel(struct sr_entity *e, int slot)
+{
+  int pos = e->timerpos[slot];
+
+  if (pos < 0)
+    return;
+  e->timerpos[slot] = -1;
+  if (--e->ntimers == pos)
+    return;
+  timer_place(e, e->timerheap[e->ntimers], pos);
+  if (pos > 0 && e->deadline[e->timerheap[pos]] < e->deadline[e->timerheap[(pos - 1) / 2]])
+    timer_siftup(e, pos);
+  else
+    timer_siftdown(e, pos);
+}
+
+/* (re)start the retransmission timer of a slot */
+static void timer_set(struct sr_entity *e, int slot, double deadline)
+{
+  timer_cancel(e, slot);
+  e->deadline[slot] = deadline;
+  timer_place(e, slot, e->ntimers++);
+  timer_siftup(e, e->ntimers - 1);
+}
+
+/* point the emulator's timer at the earliest pending deadline */
+static void timer_rearm(struct sim *s, struct sr_entity *e, int AorB)
+{
+  double want = e->ntimers > 0 ? e->deadline[e->timerheap[0]] : -1.0;
+
+  if (e->ackdue >= 0 && (want < 0 || e->ackdue < want))
+    want = e->ackdue;
+  if (want == e->armed)
+    return;
+  if (e->armed >= 0)
+    stoptimer(s, AorB);
+  if (want >= 0)
+    starttimer(s, AorB, want - sim_time(s));
+  e->armed = want;
 }
 
-void A_init(void)
+/* without per-packet timers, give the oldest unacked packet its
+   deadline if it has none yet */
+static void base_timer(struct sim *s, struct sr *r, struct sr_entity *e)
 {
+  int slot = (int)(e->send_base & r->mask);
+
+  if (!r->pktimers && e->send_base < e->nextseqnum && e->timerpos[slot] < 0)
+    timer_set(e, slot, sim_time(s) + rto_timeout(&e->rto));
+}
+
+/* set up an entity.  Without --bidirectional B only receives. */
+static void entity_init(struct sim *s, int AorB)
+{
+  struct sr *r = sr_setup(s);
+  struct sr_entity *e = &r->e[AorB];
   int i;
-  A_nextseqnum = 0;
-  send_base = 0;
-  for (i = 0; i < SEQSPACE; i++) {
-      A_acked_status[i] = false;
+  e->nextseqnum = 0;
+  e->send_base = 0;
+  for (i = 0; i <= r->mask; i++) {
+      e->timerpos[i] = -1;
   }
+  e->ntimers = 0;
+  e->armed = -1.0;
+  rto_init(&e->rto, sim_config(s)->timeout, RTT);
+  e->expectedseqnum = 0;
+  e->ackheld = -1;
+  e->ackdue = -1.0;
 }
 
-void A_output(struct msg message)
+void A_init(struct sim *s)
 {
+  entity_init(s, A);
+}
+
+/* the ACK field of a data packet: with data going both ways, the ACK
+   held back, or with SACK the cumulative ACK, which stands in for any
+   held back.  The caller rearms the timer. */
+static int piggyback_ack(struct sim *s, struct sr *r, int AorB)
+{
+  struct sr_entity *e = &r->e[AorB];
+  int ack = NOTINUSE;
+
+  if (!r->bidirectional)
+    return NOTINUSE;
+  if (r->sack) {
+    ack = (int)(e->expectedseqnum % r->seqspace);
+    if (e->unacked > 0)
+      sim_stats(s)->piggybacked++;
+    e->unacked = 0;
+  }
+  else if (e->ackheld >= 0) {
+    ack = e->ackheld;
+    e->ackheld = -1;
+    sim_stats(s)->piggybacked++;
+  }
+  e->ackdue = -1.0;
+  return ack;
+}
+
+/* send a message as the next packet; the window must have room */
+static void send_message(struct sim *s, struct sr *r, int AorB, const struct msg *message)
+{
+  struct sr_entity *e = &r->e[AorB];
   struct pkt sendpkt;
   int i;
-  int buffered_count = (A_nextseqnum - send_base + SEQSPACE) % SEQSPACE;
+  int slot = (int)(e->nextseqnum & r->mask);
 
-  if (buffered_count < WINDOWSIZE)
-  {
-    if (TRACE > 1) printf("----A: New message arrives, send window is not full, send new messge to layer3!\n");
+  sendpkt.seqnum = (int)(e->nextseqnum % r->seqspace);
+  sendpkt.acknum = piggyback_ack(s, r, AorB);
+  for (i = 0; i < 20; i++) sendpkt.payload[i] = message->data[i];
+  sendpkt.checksum = ComputeChecksum(s, &sendpkt);
 
-    sendpkt.seqnum = A_nextseqnum;
-    sendpkt.acknum = NOTINUSE;
-    for (i = 0; i < 20; i++) sendpkt.payload[i] = message.data[i];
-    sendpkt.checksum = ComputeChecksum(sendpkt);
+  e->send_buffer[slot] = sendpkt;
+  bit_clear(e->acked, slot);
 
-    A_send_buffer[A_nextseqnum % SEQSPACE] = sendpkt;
-    A_acked_status[A_nextseqnum % SEQSPACE] = false;
+  if (TRACE_GT(s, 0)) printf("Sending packet %d to layer 3\n", sendpkt.seqnum);
+  tolayer3_ptr(s, AorB, &sendpkt);
 
-    if (TRACE > 0) printf("Sending packet %d to layer 3\n", sendpkt.seqnum);
-    tolayer3(A, sendpkt);
+  e->sendtime[slot] = sim_time(s);
+  bit_clear(e->resent, slot);
+  if (r->pktimers || e->send_base == e->nextseqnum)
+    timer_set(e, slot, sim_time(s) + rto_timeout(&e->rto));
+  timer_rearm(s, e, AorB);
 
-    if (send_base == A_nextseqnum) {
-        starttimer(A, RTT);
-    }
+  e->nextseqnum++;
+}
+
+/* send backlogged messages while the window has room */
+static void drain_backlog(struct sim *s, struct sr *r, int AorB)
+{
+  struct sr_entity *e = &r->e[AorB];
+  struct msg message;
+
+  while (e->nextseqnum - e->send_base < r->windowsize
+         && backlog_get(s, &e->backlog, &message)) {
+    if (TRACE_GT(s, 1)) printf("----%c: window has room, send backlogged message to layer3!\n", 'A' + AorB);
+    send_message(s, r, AorB, &message);
+  }
+}
 
-    A_nextseqnum = (A_nextseqnum + 1) % SEQSPACE;
+static void entity_output(struct sim *s, int AorB, const struct msg *message)
+{
+  struct sr *r = sr_state(s);
+  struct sr_entity *e = &r->e[AorB];
+
+  if (e->nextseqnum - e->send_base < r->windowsize)
+  {
+    if (TRACE_GT(s, 1)) printf("----%c: New message arrives, send window is not full, send new messge to layer3!\n", 'A' + AorB);
+    send_message(s, r, AorB, message);
+  }
+  else if (backlog_put(s, &e->backlog, message))
+  {
+    if (TRACE_GT(s, 0)) printf("----%c: New message arrives, send window is full, message backlogged\n", 'A' + AorB);
   }
   else
   {
-    if (TRACE > 0) printf("----A: New message arrives, send window is full\n");
-    window_full++;
+    if (TRACE_GT(s, 0)) printf("----%c: New message arrives, send window is full\n", 'A' + AorB);
+    sim_stats(s)->window_full++;
   }
 }
 
-void A_input(struct pkt packet)
+void A_output(struct sim *s, struct msg message)
 {
-    if (IsCorrupted(packet))
-    {
-       if (TRACE > 0) printf ("----A: corrupted ACK is received, do nothing!\n");
-       return;
-    }
+  entity_output(s, A, &message);
+}
 
-    if (TRACE > 0) printf("----A: uncorrupted ACK %d is received\n", packet.acknum);
-    total_ACKs_received++;
+/* messages the entity would send at once: the room left in the window,
+   none while messages are waiting in the backlog */
+static int entity_room(struct sim *s, int AorB)
+{
+  struct sr *r = sr_state(s);
+  struct sr_entity *e = &r->e[AorB];
 
-    bool in_window = false;
-    if (send_base <= A_nextseqnum) {
-        in_window = (packet.acknum >= send_base && packet.acknum < A_nextseqnum);
-    } else {
-        in_window = (packet.acknum >= send_base || packet.acknum < A_nextseqnum);
-    }
+  return e->backlog.count > 0 ? 0 : r->windowsize - (int)(e->nextseqnum - e->send_base);
+}
 
-    if (!in_window) {
-        return;
-    }
+int A_room(struct sim *s)
+{
+  return entity_room(s, A);
+}
 
-    int ack_index = packet.acknum % SEQSPACE;
+/* the packet in the slot has been ACKed.  Returns false if
+   it already was. */
+static bool ack_packet(struct sim *s, struct sr_entity *e, int slot)
+{
+  if (bit_test(e->acked, slot))
+    return false;
+  bit_set(e->acked, slot);
+  /* only a packet sent once gives an unambiguous round trip (Karn) */
+  if (!bit_test(e->resent, slot))
+    rto_sample(&e->rto, sim_time(s) - e->sendtime[slot]);
+  timer_cancel(e, slot);
+  return true;
+}
 
-    if (A_acked_status[ack_index]) {
-       if (TRACE > 0) printf ("----A: duplicate ACK %d received, do nothing!\n");
-       return;
-    }
+/* a SACK: everything before acknum has arrived, and so has packet
+   acknum + 1 + i for every bit i set in bitmap.  A SACK riding on data
+   has no bitmap. */
+static void ack_input_sack(struct sim *s, struct sr *r, int AorB, const struct pkt *packet,
+                           const char *bitmap)
+{
+  struct sr_entity *e = &r->e[AorB];
+  long long cum, seq;
+  int offset, i;
+  bool fresh = false;
+
+  offset = (packet->acknum - (int)(e->send_base % r->seqspace) + r->seqspace) % r->seqspace;
+  if (packet->acknum < 0 || offset > e->nextseqnum - e->send_base) {
+    if (TRACE_GT(s, 0)) printf("----%c: old SACK %d, do nothing!\n", 'A' + AorB, packet->acknum);
+    return;
+  }
+  cum = e->send_base + offset;
+  for (seq = e->send_base; seq < cum; seq++)
+    fresh |= ack_packet(s, e, (int)(seq & r->mask));
+  for (i = 0; bitmap != NULL && i < SACKBYTES * 8 && cum + 1 + i < e->nextseqnum; i++)
+    if ((bitmap[i / 8] >> (i % 8)) & 1)
+      fresh |= ack_packet(s, e, (int)((cum + 1 + i) & r->mask));
+
+  if (fresh) {
+    if (TRACE_GT(s, 0)) printf("----%c: SACK %d acknowledges new packets\n", 'A' + AorB, packet->acknum);
+    sim_stats(s)->new_ACKs++;
+    e->send_base += bit_run(r, e->acked, e->send_base, e->nextseqnum - e->send_base);
+    base_timer(s, r, e);
+    timer_rearm(s, e, AorB);
+    drain_backlog(s, r, AorB);
+  }
+  else if (TRACE_GT(s, 0))
+    printf("----%c: duplicate SACK %d received, do nothing!\n", 'A' + AorB, packet->acknum);
+}
 
-    if (TRACE > 0) printf("----A: ACK %d is not a duplicate\n", packet.acknum);
-    A_acked_status[ack_index] = true;
-    new_ACKs++;
+/* an intact packet carrying an ACK has arrived at AorB */
+static void ack_input(struct sim *s, struct sr *r, int AorB, const struct pkt *packet)
+{
+    struct sr_entity *e = &r->e[AorB];
+    int offset;
 
-    if (packet.acknum == send_base) {
-        stoptimer(A);
+    if (TRACE_GT(s, 0)) printf("----%c: uncorrupted ACK %d is received\n", 'A' + AorB, packet->acknum);
+    sim_stats(s)->total_ACKs_received++;
 
-        while (send_base != A_nextseqnum && A_acked_status[send_base % SEQSPACE] == true) {
-            A_acked_status[send_base % SEQSPACE] = false;
-            send_base = (send_base + 1) % SEQSPACE;
-        }
+    if (r->sack) {
+        ack_input_sack(s, r, AorB, packet, packet->seqnum == NOTINUSE ? packet->payload : NULL);
+        return;
+    }
 
-        if (send_base != A_nextseqnum) {
-            starttimer(A, RTT);
-        }
+    /* how far past send_base the ACKed packet is */
+    offset = (int)((packet->acknum - e->send_base % r->seqspace + r->seqspace) % r->seqspace);
+    if (packet->acknum < 0 || offset >= e->nextseqnum - e->send_base) {
+        return;
     }
+
+    if (!ack_packet(s, e, (int)((e->send_base + offset) & r->mask))) {
+       if (TRACE_GT(s, 0)) printf ("----%c: duplicate ACK %d received, do nothing!\n", 'A' + AorB, packet->acknum);
+       return;
+    }
+
+    if (TRACE_GT(s, 0)) printf("----%c: ACK %d is not a duplicate\n", 'A' + AorB, packet->acknum);
+    sim_stats(s)->new_ACKs++;
+
+    /* slide the window over every packet ACKed from the base on, and
+       fill the room that makes from the backlog */
+    if (offset == 0)
+        e->send_base += bit_run(r, e->acked, e->send_base, e->nextseqnum - e->send_base);
+    base_timer(s, r, e);
+    timer_rearm(s, e, AorB);
+    if (offset == 0)
+        drain_backlog(s, r, AorB);
 }
 
+static void send_ack(struct sim *s, struct sr *r, int AorB, int seqnum);
 
-void A_timerinterrupt(void)
+/* resend only the packets whose own deadline has passed, and send an
+   ACK that has been held back long enough */
+static void entity_timerinterrupt(struct sim *s, int AorB)
 {
-    if (send_base == A_nextseqnum) {
-         return;
+    struct sr *r = sr_state(s);
+    struct sr_entity *e = &r->e[AorB];
+    struct pkt *packet;
+    double now = sim_time(s);
+    int slot, ack;
+
+    e->armed = -1.0;   /* the emulator timer has just gone off */
+
+    slot = (int)(e->send_base & r->mask);
+    if (e->ntimers > 0 && e->deadline[e->timerheap[0]] <= now + TIMER_SLACK) {
+        if (TRACE_GT(s, 0))
+            printf("----%c: time out, resend packets!\n", 'A' + AorB);
+        /* back off once per round of losses, when the oldest packet times out,
+           rather than once for every packet of the window */
+        if (e->timerpos[slot] >= 0 && e->deadline[slot] <= now + TIMER_SLACK)
+            rto_timedout(&e->rto);
     }
 
-    int base_index = send_base % SEQSPACE;
-    struct pkt base_packet = A_send_buffer[base_index];
+    while (e->ntimers > 0 && e->deadline[e->timerheap[0]] <= now + TIMER_SLACK) {
+        slot = e->timerheap[0];
+        packet = &e->send_buffer[slot];
+        if (TRACE_GT(s, 0))
+            printf("---%c: resending packet %d\n", 'A' + AorB, packet->seqnum);
+        /* with data going both ways the resend takes any ACK held back.
+           It must not repeat the ACK it first carried: by now that
+           seqnum may stand for a later packet of the peer's window. */
+        if (r->bidirectional && (ack = piggyback_ack(s, r, AorB)) != packet->acknum) {
+            packet->acknum = ack;
+            packet->checksum = ComputeChecksum(s, packet);
+        }
+        tolayer3_ptr(s, AorB, packet);
+        sim_stats(s)->packets_resent++;
+        bit_set(e->resent, slot);
+        timer_set(e, slot, now + rto_timeout(&e->rto));
+    }
 
-    if (TRACE > 0) {
-        printf("----A: time out, resend packets!\n");
-        printf("---A: resending packet %d\n", base_packet.seqnum);
+    if (e->ackdue >= 0 && e->ackdue <= now + TIMER_SLACK) {
+        e->ackdue = -1.0;
+        if (e->ackheld >= 0 || (r->sack && e->unacked > 0))
+            send_ack(s, r, AorB, e->ackheld);
     }
 
-    tolayer3(A, base_packet);
-    packets_resent++;
+    timer_rearm(s, e, AorB);
+}
 
-    starttimer(A, RTT);
+void A_timerinterrupt(struct sim *s)
+{
+    entity_timerinterrupt(s, A);
 }
 
-void B_init(void)
+void B_init(struct sim *s)
 {
-  int i;
-  expectedseqnum = 0;
-  for (i = 0; i < SEQSPACE; i++) {
-      B_recv_buffer[i].seqnum = NOTINUSE;
-  }
+  entity_init(s, B);
 }
 
-void B_input(struct pkt packet)
+/* ACK packet seqnum.  In SACK mode every ACK instead carries the next
+   packet expected and a bitmap of the packets buffered after it, bit i
+   of the payload standing for packet expected + 1 + i.  A bare ACK
+   takes the place of any ACK held back. */
+static void send_ack(struct sim *s, struct sr *r, int AorB, int seqnum)
 {
+  struct sr_entity *e = &r->e[AorB];
   struct pkt ackpkt;
   int i;
 
-  if (IsCorrupted(packet)) {
-    return;
+  if (seqnum == e->ackheld || r->sack) {
+    e->ackheld = -1;
+    e->unacked = 0;
+    if (e->ackdue >= 0) {
+      e->ackdue = -1.0;
+      timer_rearm(s, e, AorB);
+    }
   }
 
-  if (TRACE > 0) printf("----B: packet %d is correctly received, send ACK!\n",packet.seqnum);
-  packets_received++;
-
-  bool in_recv_window = is_seq_in_window(packet.seqnum, expectedseqnum, WINDOWSIZE, SEQSPACE);
-  bool in_lower_window = is_seq_in_window(packet.seqnum, (expectedseqnum - WINDOWSIZE + SEQSPACE) % SEQSPACE, WINDOWSIZE, SEQSPACE);
-
-  if (in_recv_window) {
+  ackpkt.seqnum = NOTINUSE;
+  ackpkt.acknum = seqnum;
+  for (i = 0; i < 20; i++) ackpkt.payload[i] = '0';
+  if (r->sack) {
+    ackpkt.acknum = (int)(e->expectedseqnum % r->seqspace);
+    memset(ackpkt.payload, 0, SACKBYTES);
+    for (i = 0; i < SACKBYTES * 8 && i + 1 < r->windowsize; i++)
+      if (bit_test(e->received, (int)((e->expectedseqnum + 1 + i) & r->mask)))
+        ackpkt.payload[i / 8] |= (char)(1 << (i % 8));
+  }
+  ackpkt.checksum = ComputeChecksum(s, &ackpkt);
+  tolayer3_ptr(s, AorB, &ackpkt);
+}
 
-      ackpkt.seqnum = NOTINUSE;
-      ackpkt.acknum = packet.seqnum;
-      for (i = 0; i < 20; i++) ackpkt.payload[i] = '0';
-      ackpkt.checksum = ComputeChecksum(ackpkt);
-      tolayer3(B, ackpkt);
+/* acknowledge data packet seqnum.  With data going both ways the ACK is
+   held back for up to ackdelay, so that it can go on a data packet: one
+   ACK, or with SACK one in-order packet's worth, at most.  A SACK for a
+   packet that arrived out of order goes at once, as the bitmap is news
+   the sender can act on. */
+static void ack_data(struct sim *s, struct sr *r, int AorB, int seqnum, bool inorder)
+{
+  struct sr_entity *e = &r->e[AorB];
 
-      int buffer_index = packet.seqnum % SEQSPACE;
-      if (B_recv_buffer[buffer_index].seqnum == NOTINUSE) {
-          B_recv_buffer[buffer_index] = packet;
+  if (!r->bidirectional) {
+    send_ack(s, r, AorB, seqnum);
+    return;
+  }
+  if (r->sack) {
+    if (!inorder || ++e->unacked >= 2) {
+      send_ack(s, r, AorB, seqnum);
+      return;
+    }
+  }
+  else {
+    if (e->ackheld >= 0)
+      send_ack(s, r, AorB, e->ackheld);
+    e->ackheld = seqnum;
+  }
+  if (e->ackdue < 0) {
+    e->ackdue = sim_time(s) + sim_config(s)->ackdelay;
+    timer_rearm(s, e, AorB);
+  }
+}
 
-          while (B_recv_buffer[expectedseqnum % SEQSPACE].seqnum != NOTINUSE) {
-              tolayer5(B, B_recv_buffer[expectedseqnum % SEQSPACE].payload);
-              B_recv_buffer[expectedseqnum % SEQSPACE].seqnum = NOTINUSE;
-              expectedseqnum = (expectedseqnum + 1) % SEQSPACE;
+/* an intact data packet has arrived at the receiver of AorB */
+static void data_input(struct sim *s, struct sr *r, int AorB, const struct pkt *packet)
+{
+  struct sr_entity *e = &r->e[AorB];
+  int expected, ahead, behind, slot;
+
+  if (TRACE_GT(s, 0)) printf("----%c: packet %d is correctly received, send ACK!\n", 'A' + AorB, packet->seqnum);
+  sim_stats(s)->packets_received++;
+
+  /* how far the packet is ahead of, or behind, the one expected next */
+  expected = (int)(e->expectedseqnum % r->seqspace);
+  ahead = (packet->seqnum - expected + r->seqspace) % r->seqspace;
+  behind = (expected - packet->seqnum + r->seqspace) % r->seqspace;
+
+  if (ahead < r->windowsize) {
+      slot = (int)((e->expectedseqnum + ahead) & r->mask);
+      if (bit_test(e->received, slot))
+          sim_stats(s)->spurious_resends++;
+      else {
+          memcpy(e->payload[slot], packet->payload, 20);
+          bit_set(e->received, slot);
+
+          slot = (int)(e->expectedseqnum & r->mask);
+          while (bit_test(e->received, slot)) {
+              tolayer5(s, AorB, e->payload[slot]);
+              bit_clear(e->received, slot);
+              e->expectedseqnum++;
+              slot = (int)(e->expectedseqnum & r->mask);
           }
       }
+      ack_data(s, r, AorB, packet->seqnum, ahead == 0);
       return;
   }
 
-  if (in_lower_window) {
-      ackpkt.seqnum = NOTINUSE;
-      ackpkt.acknum = packet.seqnum;
-      for (i = 0; i < 20; i++) ackpkt.payload[i] = '0';
-      ackpkt.checksum = ComputeChecksum(ackpkt);
-      tolayer3(B, ackpkt);
+  if (behind >= 1 && behind <= r->windowsize) {
+      sim_stats(s)->spurious_resends++;
+      ack_data(s, r, AorB, packet->seqnum, false);
       return;
   }
 
   return;
 }
 
-void B_output(struct msg message)
+/* a packet has arrived from layer 3.  An intact one goes to the sender
+   if its acknum is in use and to the receiver if its seqnum is; without
+   --bidirectional A only gets bare ACKs and B only data. */
+static void entity_input(struct sim *s, int AorB, const struct pkt *packet)
 {
+    struct sr *r = sr_state(s);
+
+    if (IsCorrupted(s, packet))
+    {
+       if (TRACE_GT(s, 0) && AorB == A && !r->bidirectional) printf ("----A: corrupted ACK is received, do nothing!\n");
+       else if (TRACE_GT(s, 0) && r->bidirectional) printf ("----%c: corrupted packet is received, do nothing!\n", 'A' + AorB);
+       return;
+    }
+
+    if (packet->acknum != NOTINUSE)
+        ack_input(s, r, AorB, packet);
+    if (packet->seqnum != NOTINUSE)
+        data_input(s, r, AorB, packet);
 }
 
-void B_timerinterrupt(void)
+void A_input_ptr(struct sim *s, const struct pkt *packet)
 {
-}
\ No newline at end of file
+    entity_input(s, A, packet);
+}
+
+void B_input_ptr(struct sim *s, const struct pkt *packet)
+{
+    entity_input(s, B, packet);
+}
+
+/* by-value entry points, for callers written against the original API */
+void A_input(struct sim *s, struct pkt packet)
+{
+    A_input_ptr(s, &packet);
+}
+
+void B_input(struct sim *s, struct pkt packet)
+{
+    B_input_ptr(s, &packet);
+}
+
+/* with --bidirectional B sends data too; otherwise it is never called */
+void B_output(struct sim *s, struct msg message)
+{
+    entity_output(s, B, &message);
+}
+
+int B_room(struct sim *s)
+{
+    return entity_room(s, B);
+}
+
+void B_timerinterrupt(struct sim *s)
+{
+    entity_timerinterrupt(s, B);
+}
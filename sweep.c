@@ -0,0 +1,487 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "emulator.h"
+#include "sweep.h"
+
+/* ******************************************************************
+   Parameter sweep runner.
+
+   Runs one simulation for every point of a grid of message count, loss
+   probability, corruption probability, corruption direction, message
+   inter-arrival time, sender options and seed.  The runs are
+   independent, so they are spread over a pool of worker threads.  Each
+   worker owns a deque of runs; it takes work from the bottom of its own
+   deque and, once that is empty, steals from the top of the others.
+   When all are empty the sweep is done.
+
+   A grid is a list of key=values separated by ';', e.g.
+
+     loss=0,0.1,0.2;corrupt=0:0.3:0.1;lambda=5,10,20;seed=1:10
+
+   keys are nsim, loss, corrupt, dir, lambda, timeout (0 fixed, 1
+   adaptive), dupacks, window, seqspace, sack, pktimers, ackevery,
+   ackdelay, bandwidth, propdelay, queue, backlog, bidirectional, flows,
+   msgsize (bytes, 0 for 20-byte messages), msgsizemax, checksum (0 sum,
+   1 CRC-32C) and seed.  Values are a comma separated list of numbers
+   or first:last[:step] ranges (step defaults to 1).  A key that is not
+   given keeps its value from the base parameters.  One CSV row is
+   written per grid point, with the results averaged over the seeds and
+   the latency distributions of all seeds pooled.
+**********************************************************************/
+
+#define MAXVALUES 1024   /* most values one key can take */
+
+enum { NSIM, LOSS, CORRUPT, DIR, LAMBDA, TIMEOUT, DUPACKS, WINDOW, SEQSPACE, SACK,
+       PKTIMERS, ACKEVERY, ACKDELAY, BANDWIDTH, PROPDELAY, QUEUE, BACKLOG,
+       BIDIR, FLOWS, MSGSIZE, MSGSIZEMAX, CHECKSUM, SEED, NAXES };
+
+static const char *axisnames[NAXES] = {
+  "nsim", "loss", "corrupt", "dir", "lambda", "timeout", "dupacks", "window", "seqspace", "sack",
+  "pktimers", "ackevery", "ackdelay", "bandwidth", "propdelay", "queue", "backlog",
+  "bidirectional", "flows", "msgsize", "msgsizemax", "checksum", "seed"
+};
+
+struct axis {
+  int n;                 /* number of values, 0 if not part of the grid */
+  double v[MAXVALUES];
+};
+
+struct grid {
+  struct axis axes[NAXES];
+  struct sim_params base;
+  int nruns;             /* product of all axis sizes */
+};
+
+/* one worker's share of the runs.  The owner pops from the bottom, other
+   workers steal from the top. */
+struct deque {
+  pthread_mutex_t lock;
+  int *runs;
+  int top, bottom;
+};
+
+struct worker {
+  pthread_t thread;
+  int started;           /* thread was created and has to be joined */
+  int id;
+  struct sweep *sw;
+  struct deque dq;
+};
+
+struct sweep {
+  struct grid *g;
+  struct worker *workers;
+  int nworkers;
+  struct sim_stats *results;   /* one per run, indexed by run number */
+  int *failed;                 /* set if the run could not be created */
+};
+
+/* parse "v1,v2,first:last:step,..." into axis a */
+static int parse_values(struct axis *a, const char *text)
+{
+  char *copy, *item, *save;
+  double first, last, step, x;
+  int n, k;
+
+  copy = strdup(text);
+  if (copy == NULL)
+    return -1;
+  a->n = 0;
+  for (item = strtok_r(copy, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save)) {
+    step = 1.0;
+    n = sscanf(item, "%lf:%lf:%lf", &first, &last, &step);
+    if (n < 1 || step <= 0.0) {
+      free(copy);
+      return -1;
+    }
+    if (n == 1)
+      last = first;
+    /* the half-step slack keeps rounding from dropping the last value */
+    for (k = 0; (x = first + k * step) <= last + step/2; k++) {
+      if (a->n == MAXVALUES) {
+        free(copy);
+        return -1;
+      }
+      a->v[a->n++] = x;
+    }
+  }
+  free(copy);
+  return a->n > 0 ? 0 : -1;
+}
+
+static void default_value(struct axis *a, double v)
+{
+  if (a->n == 0) {
+    a->v[0] = v;
+    a->n = 1;
+  }
+}
+
+static int parse_grid(struct grid *g, const char *text)
+{
+  char *copy, *item, *save, *eq;
+  long long nruns;
+  int i;
+
+  copy = strdup(text);
+  if (copy == NULL)
+    return -1;
+  for (item = strtok_r(copy, "; ", &save); item != NULL; item = strtok_r(NULL, "; ", &save)) {
+    eq = strchr(item, '=');
+    if (eq == NULL) {
+      fprintf(stderr, "sweep: expected key=values, got \"%s\"\n", item);
+      free(copy);
+      return -1;
+    }
+    *eq = '\0';
+    for (i = 0; i < NAXES; i++)
+      if (strcmp(item, axisnames[i]) == 0)
+        break;
+    if (i == NAXES) {
+      fprintf(stderr, "sweep: unknown key \"%s\"\n", item);
+      free(copy);
+      return -1;
+    }
+    if (parse_values(&g->axes[i], eq + 1) != 0) {
+      fprintf(stderr, "sweep: bad values for %s: \"%s\"\n", item, eq + 1);
+      free(copy);
+      return -1;
+    }
+  }
+  free(copy);
+
+  /* keys that were not given keep their base value */
+  default_value(&g->axes[NSIM], g->base.nsimmax);
+  default_value(&g->axes[LOSS], g->base.lossprob);
+  default_value(&g->axes[CORRUPT], g->base.corruptprob);
+  default_value(&g->axes[DIR], g->base.corruptdirection);
+  default_value(&g->axes[LAMBDA], g->base.lambda);
+  default_value(&g->axes[TIMEOUT], g->base.timeout);
+  default_value(&g->axes[DUPACKS], g->base.dupacks);
+  default_value(&g->axes[WINDOW], g->base.windowsize);
+  default_value(&g->axes[SEQSPACE], g->base.seqspace);
+  default_value(&g->axes[SACK], g->base.sack);
+  default_value(&g->axes[PKTIMERS], g->base.pktimers);
+  default_value(&g->axes[ACKEVERY], g->base.ackevery);
+  default_value(&g->axes[ACKDELAY], g->base.ackdelay);
+  default_value(&g->axes[BANDWIDTH], g->base.bandwidth);
+  default_value(&g->axes[PROPDELAY], g->base.propdelay);
+  default_value(&g->axes[QUEUE], g->base.queuelimit);
+  default_value(&g->axes[BACKLOG], g->base.backlog);
+  default_value(&g->axes[BIDIR], g->base.bidirectional);
+  default_value(&g->axes[FLOWS], g->base.flows);
+  default_value(&g->axes[MSGSIZE], g->base.msgsize);
+  default_value(&g->axes[MSGSIZEMAX], g->base.msgsizemax);
+  default_value(&g->axes[CHECKSUM], g->base.checksum);
+  default_value(&g->axes[SEED], g->base.seed);
+
+  /* each axis has at most MAXVALUES values, so checking after every
+     factor keeps the product well inside a long long */
+  nruns = 1;
+  for (i = 0; i < NAXES; i++) {
+    nruns *= g->axes[i].n;
+    if (nruns > INT_MAX) {
+      fprintf(stderr, "sweep: grid has too many runs (more than %d)\n", INT_MAX);
+      return -1;
+    }
+  }
+  g->nruns = (int)nruns;
+  return 0;
+}
+
+/* the value of each axis for a run.  The seed varies fastest, so the runs
+   of one grid point are numbered consecutively. */
+static void run_values(const struct grid *g, int run, double v[NAXES])
+{
+  int i;
+
+  for (i = NAXES - 1; i >= 0; i--) {
+    v[i] = g->axes[i].v[run % g->axes[i].n];
+    run /= g->axes[i].n;
+  }
+}
+
+static void run_params(const struct grid *g, int run, struct sim_params *p)
+{
+  double v[NAXES];
+
+  run_values(g, run, v);
+  *p = g->base;
+  p->nsimmax = (long long)v[NSIM];
+  p->lossprob = v[LOSS];
+  p->corruptprob = v[CORRUPT];
+  p->corruptdirection = (int)v[DIR];
+  p->lambda = v[LAMBDA];
+  p->timeout = (int)v[TIMEOUT];
+  p->dupacks = (int)v[DUPACKS];
+  p->windowsize = (int)v[WINDOW];
+  p->seqspace = (int)v[SEQSPACE];
+  p->sack = (int)v[SACK];
+  p->pktimers = (int)v[PKTIMERS];
+  p->ackevery = (int)v[ACKEVERY];
+  p->ackdelay = v[ACKDELAY];
+  p->bandwidth = v[BANDWIDTH];
+  p->propdelay = v[PROPDELAY];
+  p->queuelimit = (int)v[QUEUE];
+  p->backlog = (int)v[BACKLOG];
+  p->bidirectional = (int)v[BIDIR];
+  p->flows = (int)v[FLOWS];
+  p->msgsize = (int)v[MSGSIZE];
+  p->msgsizemax = (int)v[MSGSIZEMAX];
+  p->checksum = (int)v[CHECKSUM];
+  p->seed = (unsigned long long)v[SEED];
+  p->trace = 0;
+  p->tracefile = NULL;     /* runs in parallel can't share one trace */
+}
+
+static void run_one(struct sweep *sw, int run)
+{
+  struct sim_params p;
+  struct sim *s;
+
+  run_params(sw->g, run, &p);
+  s = sim_create(&p);
+  if (s == NULL) {
+    sw->failed[run] = 1;
+    return;
+  }
+  sim_run(s);
+  sw->results[run] = *sim_results(s);
+  sim_destroy(s);
+}
+
+/* next run from the bottom of our own deque, -1 if it is empty */
+static int pop_bottom(struct deque *dq)
+{
+  int run = -1;
+
+  pthread_mutex_lock(&dq->lock);
+  if (dq->bottom > dq->top)
+    run = dq->runs[--dq->bottom];
+  pthread_mutex_unlock(&dq->lock);
+  return run;
+}
+
+/* oldest run from the top of somebody else's deque, -1 if it is empty */
+static int steal_top(struct deque *dq)
+{
+  int run = -1;
+
+  pthread_mutex_lock(&dq->lock);
+  if (dq->bottom > dq->top)
+    run = dq->runs[dq->top++];
+  pthread_mutex_unlock(&dq->lock);
+  return run;
+}
+
+static void *worker_main(void *arg)
+{
+  struct worker *w = arg;
+  struct sweep *sw = w->sw;
+  int run, i;
+
+  for (;;) {
+    run = pop_bottom(&w->dq);
+    /* no new runs are ever created, so once every deque is empty we are done */
+    for (i = 1; run < 0 && i < sw->nworkers; i++)
+      run = steal_top(&sw->workers[(w->id + i) % sw->nworkers].dq);
+    if (run < 0)
+      return NULL;
+    run_one(sw, run);
+  }
+}
+
+static void write_results(FILE *out, const struct sweep *sw)
+{
+  const struct grid *g = sw->g;
+  int nseeds = g->axes[SEED].n;
+  int point, k, run, nok;
+  double v[NAXES];
+  double delivered, delivered2, resent, spurious, fast, avoided, full, acks, sentb, endtime;
+  double tput, tput2, x, util, qmean, qmax, drops, backlogged, blmax, tputab, tputba, piggy;
+  double fair, bytes;
+  const struct sim_stats *st;
+  struct hist latency;         /* all seeds of a point pooled together */
+  struct hist bldelay;
+
+  fprintf(out, "nsim,loss,corrupt,dir,lambda,timeout,dupacks,window,seqspace,sack,pktimers,"
+          "ackevery,ackdelay,bandwidth,propdelay,queue,backlog,bidirectional,flows,msgsize,msgsizemax,"
+          "checksum,seeds,delivered,delivered_sd,"
+          "resent,spurious,fast_retransmits,timeouts_avoided,window_full,new_acks,sent_by_b,end_time,throughput,throughput_sd,"
+          "latency_p50,latency_p99,latency_max,link_util,queue_mean,queue_max,queue_drops,"
+          "backlogged,backlog_max,backlog_delay_p50,backlog_delay_p99,"
+          "throughput_ab,throughput_ba,piggybacked,fairness,throughput_bytes\n");
+  for (point = 0; point < g->nruns / nseeds; point++) {
+    delivered = delivered2 = resent = spurious = fast = avoided = 0.0;
+    full = acks = sentb = endtime = tput = tput2 = 0.0;
+    util = qmean = qmax = drops = backlogged = blmax = tputab = tputba = piggy = fair = bytes = 0.0;
+    nok = 0;
+    hist_init(&latency);
+    hist_init(&bldelay);
+    for (k = 0; k < nseeds; k++) {
+      run = point * nseeds + k;
+      if (sw->failed[run])
+        continue;
+      st = &sw->results[run];
+      nok++;
+      delivered += st->messages_delivered;
+      delivered2 += (double)st->messages_delivered * st->messages_delivered;
+      resent += st->packets_resent;
+      spurious += st->spurious_resends;
+      fast += st->fast_retransmits;
+      avoided += st->timeouts_avoided;
+      full += st->window_full;
+      acks += st->new_ACKs;
+      sentb += st->sent[B];
+      endtime += st->time;
+      x = st->time > 0 ? st->messages_delivered / st->time : 0.0;
+      tput += x;
+      tput2 += x * x;
+      hist_merge(&latency, &st->latency);
+      /* the link of the data direction, A->B */
+      if (st->time > 0) {
+        util += st->link_busy[A] / st->time;
+        qmean += st->queue_area[A] / st->time;
+      }
+      qmax += st->queue_max[A];
+      drops += st->queue_drops[A];
+      backlogged += st->backlogged;
+      blmax += st->backlog_max;
+      hist_merge(&bldelay, &st->backlog_delay);
+      if (st->time > 0) {
+        tputab += st->delivered[B] / st->time;
+        tputba += st->delivered[A] / st->time;
+      }
+      piggy += st->piggybacked;
+      fair += st->fairness;
+      if (st->time > 0)
+        bytes += st->bytes_delivered / st->time;
+    }
+    run_values(g, point * nseeds, v);
+    fprintf(out, "%lld,%g,%g,%d,%g,%d,%d,%d,%d,%d,%d,%d,%g,%g,%g,%d,%d,%d,%d,%d,%d,%d,%d",
+            (long long)v[NSIM], v[LOSS], v[CORRUPT], (int)v[DIR], v[LAMBDA], (int)v[TIMEOUT],
+            (int)v[DUPACKS], (int)v[WINDOW], (int)v[SEQSPACE], (int)v[SACK], (int)v[PKTIMERS],
+            (int)v[ACKEVERY], v[ACKDELAY], v[BANDWIDTH], v[PROPDELAY], (int)v[QUEUE],
+            (int)v[BACKLOG], (int)v[BIDIR], (int)v[FLOWS], (int)v[MSGSIZE], (int)v[MSGSIZEMAX],
+            (int)v[CHECKSUM], nok);
+    if (nok == 0) {
+      fprintf(out, ",,,,,,,,,,,,,,,,,,,,,,,,,,,,\n");
+      continue;
+    }
+    delivered /= nok;
+    tput /= nok;
+    fprintf(out, ",%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.6f,%.6f,%.3f,%.3f,%.3f,"
+            "%.4f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.6f,%.6f,%.3f,%.4f,%.3f\n",
+            delivered, sqrt(fmax(delivered2 / nok - delivered * delivered, 0.0)),
+            resent / nok, spurious / nok, fast / nok, avoided / nok, full / nok, acks / nok,
+            sentb / nok, endtime / nok,
+            tput, sqrt(fmax(tput2 / nok - tput * tput, 0.0)),
+            hist_quantile(&latency, 0.5), hist_quantile(&latency, 0.99), latency.max,
+            util / nok, qmean / nok, qmax / nok, drops / nok,
+            backlogged / nok, blmax / nok, hist_quantile(&bldelay, 0.5), hist_quantile(&bldelay, 0.99),
+            tputab / nok, tputba / nok, piggy / nok, fair / nok, bytes / nok);
+  }
+}
+
+int sweep_run(const char *gridtext, const struct sim_params *base,
+              int nthreads, const char *output)
+{
+  struct grid *g;
+  struct sweep sw;
+  struct worker *w;
+  FILE *out;
+  int i, run, per, started, status = 0;
+
+  g = calloc(1, sizeof(struct grid));
+  if (g == NULL)
+    return -1;
+  g->base = *base;
+  if (parse_grid(g, gridtext) != 0) {
+    free(g);
+    return -1;
+  }
+
+  if (nthreads <= 0)
+    nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (nthreads <= 0)
+    nthreads = 1;
+  if (nthreads > g->nruns)
+    nthreads = g->nruns;
+
+  sw.g = g;
+  sw.nworkers = nthreads;
+  sw.workers = calloc(nthreads, sizeof(struct worker));
+  sw.results = calloc(g->nruns, sizeof(struct sim_stats));
+  sw.failed = calloc(g->nruns, sizeof(int));
+  if (sw.workers == NULL || sw.results == NULL || sw.failed == NULL) {
+    fprintf(stderr, "sweep: out of memory\n");
+    status = -1;
+    goto done;
+  }
+
+  /* deal the runs out in contiguous blocks, so each worker starts on its
+     own grid points and only steals once it runs dry */
+  per = (g->nruns + nthreads - 1) / nthreads;
+  for (i = 0; i < nthreads; i++) {
+    w = &sw.workers[i];
+    w->id = i;
+    w->sw = &sw;
+    pthread_mutex_init(&w->dq.lock, NULL);
+    w->dq.runs = malloc(per * sizeof(int));
+    if (w->dq.runs == NULL) {
+      fprintf(stderr, "sweep: out of memory\n");
+      status = -1;
+      goto done;
+    }
+    w->dq.top = 0;
+    w->dq.bottom = 0;
+    /* pushed last-first so the owner pops them in ascending order */
+    for (run = (i + 1) * per - 1; run >= i * per; run--)
+      if (run < g->nruns)
+        w->dq.runs[w->dq.bottom++] = run;
+  }
+
+  /* a worker that fails to start leaves its deque to be stolen from by
+     the others; if none start, this thread does all the runs itself */
+  started = 0;
+  for (i = 0; i < nthreads; i++)
+    if (pthread_create(&sw.workers[i].thread, NULL, worker_main, &sw.workers[i]) == 0) {
+      sw.workers[i].started = 1;
+      started++;
+    }
+  if (started < nthreads)
+    fprintf(stderr, "sweep: only %d of %d threads started\n", started, nthreads);
+  fprintf(stderr, "sweep: %d runs on %d threads\n", g->nruns, started > 0 ? started : 1);
+  if (started == 0)
+    worker_main(&sw.workers[0]);
+  for (i = 0; i < nthreads; i++)
+    if (sw.workers[i].started)
+      pthread_join(sw.workers[i].thread, NULL);
+
+  out = output ? fopen(output, "w") : stdout;
+  if (out == NULL) {
+    perror(output);
+    status = -1;
+    goto done;
+  }
+  write_results(out, &sw);
+  if (out != stdout)
+    fclose(out);
+
+ done:
+  if (sw.workers != NULL)
+    for (i = 0; i < nthreads; i++) {
+      free(sw.workers[i].dq.runs);
+      pthread_mutex_destroy(&sw.workers[i].dq.lock);
+    }
+  free(sw.workers);
+  free(sw.results);
+  free(sw.failed);
+  free(g);
+  return status;
+}
@@ -0,0 +1,6 @@
+/* run every point of a parameter grid on a pool of worker threads.  base
+   supplies the values of everything the grid does not vary.  Results are
+   written as CSV to output (stdout if NULL).  nthreads <= 0 uses one
+   thread per online CPU.  Returns 0 on success. */
+extern int sweep_run(const char *grid, const struct sim_params *base,
+                     int nthreads, const char *output);
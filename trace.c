@@ -0,0 +1,126 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include "trace.h"
+
+/* single producer (the simulation), single consumer (the writer thread).
+   head and tail only ever grow; the slot of a record is its position
+   masked by the ring size. */
+#define RINGSIZE  (1 << 16)              /* records, a power of two */
+#define RINGMASK  (RINGSIZE - 1)
+
+struct tracer {
+  FILE *fp;
+  pthread_t writer;
+  atomic_size_t head;           /* next record the simulation fills */
+  atomic_size_t tail;           /* next record the writer writes out */
+  atomic_int closing;           /* set once no more records will come */
+  struct trace_record ring[RINGSIZE];
+};
+
+static const char *typenames[TR_NTYPES] = {
+  "generate", "send", "receive", "deliver", "timerstart", "timerstop", "timeout"
+};
+
+static const char *verdictnames[TV_NVERDICTS] = {
+  "", "accepted", "dropped", "scheduled", "lost", "corrupted", "delivered", "overflow"
+};
+
+const char *trace_typename(int type)
+{
+  return type >= 0 && type < TR_NTYPES ? typenames[type] : "?";
+}
+
+const char *trace_verdictname(int verdict)
+{
+  return verdict >= 0 && verdict < TV_NVERDICTS ? verdictnames[verdict] : "?";
+}
+
+static void *writer_main(void *arg)
+{
+  struct tracer *t = arg;
+  struct timespec nap = { 0, 200000 };   /* 0.2ms when there is nothing to do */
+  size_t head, tail, n;
+  int closing;
+
+  for (;;) {
+    closing = atomic_load_explicit(&t->closing, memory_order_acquire);
+    head = atomic_load_explicit(&t->head, memory_order_acquire);
+    tail = atomic_load_explicit(&t->tail, memory_order_relaxed);
+    if (head == tail) {
+      if (closing)
+        return NULL;
+      nanosleep(&nap, NULL);
+      continue;
+    }
+    /* write up to the end of the ring; a wrapped batch goes next time */
+    n = head - tail;
+    if ((tail & RINGMASK) + n > RINGSIZE)
+      n = RINGSIZE - (tail & RINGMASK);
+    fwrite(&t->ring[tail & RINGMASK], sizeof(struct trace_record), n, t->fp);
+    atomic_store_explicit(&t->tail, tail + n, memory_order_release);
+  }
+}
+
+struct tracer *tracer_open(const char *path)
+{
+  struct tracer *t;
+  uint32_t recsize = sizeof(struct trace_record);
+
+  t = calloc(1, sizeof(struct tracer));
+  if (t == NULL)
+    return NULL;
+  t->fp = fopen(path, "wb");
+  if (t->fp == NULL) {
+    perror(path);
+    free(t);
+    return NULL;
+  }
+  fwrite(TRACE_MAGIC, 1, 8, t->fp);
+  fwrite(&recsize, sizeof(recsize), 1, t->fp);
+  atomic_init(&t->head, 0);
+  atomic_init(&t->tail, 0);
+  atomic_init(&t->closing, 0);
+  if (pthread_create(&t->writer, NULL, writer_main, t) != 0) {
+    fclose(t->fp);
+    free(t);
+    return NULL;
+  }
+  return t;
+}
+
+void tracer_close(struct tracer *t)
+{
+  if (t == NULL)
+    return;
+  atomic_store_explicit(&t->closing, 1, memory_order_release);
+  pthread_join(t->writer, NULL);
+  fclose(t->fp);
+  free(t);
+}
+
+void tracer_put(struct tracer *t, double time, int type, int entity, int flow,
+                int seqnum, int acknum, int verdict)
+{
+  size_t head = atomic_load_explicit(&t->head, memory_order_relaxed);
+  struct trace_record *r;
+
+  /* the ring is full: let the writer catch up */
+  while (head - atomic_load_explicit(&t->tail, memory_order_acquire) == RINGSIZE)
+    sched_yield();
+
+  r = &t->ring[head & RINGMASK];
+  r->time = time;
+  r->seqnum = seqnum;
+  r->acknum = acknum;
+  r->type = (uint8_t)type;
+  r->entity = (uint8_t)entity;
+  r->verdict = (uint8_t)verdict;
+  r->pad = 0;
+  r->flow = (uint32_t)flow;
+  atomic_store_explicit(&t->head, head + 1, memory_order_release);
+}
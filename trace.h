@@ -0,0 +1,52 @@
+#include <stdint.h>
+
+/* binary event trace.  The emulator appends fixed-size records to a ring
+   buffer and a background thread writes them to the trace file, so the
+   simulation never waits on I/O unless the writer falls a full ring
+   behind.  tracedump turns a trace file back into text or CSV. */
+
+#define TRACE_MAGIC   "SIMTRC01"    /* first 8 bytes of every trace file */
+
+/* what happened */
+#define TR_GENERATE   0   /* layer 5 handed a message to the entity */
+#define TR_SEND       1   /* entity passed a packet to layer 3 */
+#define TR_RECEIVE    2   /* layer 3 handed a packet to the entity */
+#define TR_DELIVER    3   /* entity delivered data to layer 5 */
+#define TR_TIMERSTART 4
+#define TR_TIMERSTOP  5
+#define TR_TIMEOUT    6
+#define TR_NTYPES     7
+
+/* what became of it */
+#define TV_NONE       0
+#define TV_ACCEPTED   1   /* TR_GENERATE: the sender took the message */
+#define TV_DROPPED    2   /* TR_GENERATE: the sender's window was full */
+#define TV_SCHEDULED  3   /* TR_SEND: will arrive intact */
+#define TV_LOST       4   /* TR_SEND: lost in the medium */
+#define TV_CORRUPTED  5   /* TR_SEND: will arrive corrupted */
+#define TV_DELIVERED  6   /* TR_DELIVER */
+#define TV_OVERFLOW   7   /* TR_SEND: dropped at a full link queue */
+#define TV_NVERDICTS  8
+
+struct trace_record {
+  double time;            /* simulated time */
+  int32_t seqnum;         /* packet header, -1 if no packet is involved */
+  int32_t acknum;
+  uint8_t type;           /* TR_ */
+  uint8_t entity;         /* A or B */
+  uint8_t verdict;        /* TV_ */
+  uint8_t pad;
+  uint32_t flow;          /* flow the entity belongs to, 0 with one flow */
+};
+
+/* file layout: TRACE_MAGIC, then uint32_t record size, then records */
+
+struct tracer;
+
+extern struct tracer *tracer_open(const char *path);
+extern void tracer_close(struct tracer *);   /* drains the ring first */
+extern void tracer_put(struct tracer *, double time, int type, int entity, int flow,
+                       int seqnum, int acknum, int verdict);
+
+extern const char *trace_typename(int type);
+extern const char *trace_verdictname(int verdict);
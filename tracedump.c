@@ -0,0 +1,72 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "trace.h"
+
+/* ******************************************************************
+   tracedump: print a binary trace written with --trace-file.
+
+   usage: tracedump [-c] tracefile
+
+   Prints one line per record, or CSV with -c.  Each record names the
+   entity, A or B, and the flow it belongs to.
+**********************************************************************/
+
+#define BATCH 4096
+
+int main(int argc, char **argv)
+{
+  struct trace_record recs[BATCH];
+  char magic[8];
+  uint32_t recsize;
+  const char *path = NULL;
+  int csv = 0;
+  size_t n, i;
+  FILE *fp;
+  int a;
+
+  for (a = 1; a < argc; a++) {
+    if (strcmp(argv[a], "-c") == 0)
+      csv = 1;
+    else if (path == NULL)
+      path = argv[a];
+    else {
+      path = NULL;
+      break;
+    }
+  }
+  if (path == NULL) {
+    fprintf(stderr, "usage: %s [-c] tracefile\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  fp = fopen(path, "rb");
+  if (fp == NULL) {
+    perror(path);
+    return EXIT_FAILURE;
+  }
+  if (fread(magic, 1, 8, fp) != 8 || memcmp(magic, TRACE_MAGIC, 8) != 0
+      || fread(&recsize, sizeof(recsize), 1, fp) != 1
+      || recsize != sizeof(struct trace_record)) {
+    fprintf(stderr, "%s: not a trace file from this version of the emulator\n", path);
+    fclose(fp);
+    return EXIT_FAILURE;
+  }
+
+  if (csv)
+    printf("time,type,entity,flow,seqnum,acknum,verdict\n");
+  while ((n = fread(recs, sizeof(struct trace_record), BATCH, fp)) > 0) {
+    for (i = 0; i < n; i++) {
+      if (csv)
+        printf("%.6f,%s,%c,%u,%d,%d,%s\n", recs[i].time, trace_typename(recs[i].type),
+               recs[i].entity ? 'B' : 'A', recs[i].flow, recs[i].seqnum, recs[i].acknum,
+               trace_verdictname(recs[i].verdict));
+      else
+        printf("%14.6f  %-10s %c %5u  seq %6d  ack %6d  %s\n", recs[i].time,
+               trace_typename(recs[i].type), recs[i].entity ? 'B' : 'A', recs[i].flow,
+               recs[i].seqnum, recs[i].acknum, trace_verdictname(recs[i].verdict));
+    }
+  }
+  fclose(fp);
+  return EXIT_SUCCESS;
+}